@@ -9,11 +9,26 @@
 #include <math.h>
 #include <pthread.h>
 #include <fftw3.h>
+#include <sndfile.h>
+#include <mpg123.h>
 #include <string>
 #include <fstream>
 #include <cstdint>
 #include <limits>
 #include <cstring>
+#include <strings.h>
+#include <vector>
+#include <atomic>
+#include <cstdarg>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cerrno>
+#include <algorithm>
+#include "analyzer.h"
 
 using std::fstream;
 using std::cout;
@@ -23,11 +38,60 @@ using std::string;
 using std::flush;
 
 
-static const uint8_t    SUPPORTED_CHANNELS = 2;
-static const uint8_t    GRIDS = 5;
+static const uint8_t    MAX_CHANNELS = 8;           //7.1 is the widest layout SDL can play
+static const int        MAX_BANDS = ANALYZER_MAX_BANDS;
+static const int        MIN_SPECTRUM_BARS = 32;     //-Q range
+static const int        SPECTRUM_LABEL_COLS = 4;    //columns left of a spectrum for the channel name
 static const uint8_t    CHAR_THRESHOLD = 1;
 static const uint16_t   MAX_CHAR_LEN = 1000;
+static const double     LEVEL_STEPS_PER_DB = 2.0;   //band levels are stored in 0.5 dB steps, 0 .. 127.5 dB
+static const double     PEAK_STEPS_PER_DB = 256.0;  //peak magnitudes are stored in 1/256 dB steps, 0 .. 255.99 dB
 const int               I = 1;
+static const char       WISDOM_FILE_NAME[] = ".terminal-music-visualizer.wisdom";
+static const Uint16     DEFAULT_SAMPLES = 4096;     //device buffer size in sample frames, same default SDL_LoadWAV used
+static const int        MIN_OUTPUT_FRAMES = 32;     //-b range
+static const int        MAX_OUTPUT_FRAMES = 32768;
+static const int        ADAPTIVE_START_FRAMES = 256;    //-A starts with this device buffer (~6 ms at 44.1 kHz)
+static const int        QUEUE_PERIODS = 2;          //push mode keeps this many device buffers queued to begin with
+static const long long  MAX_QUEUE_FRAMES = 65536;   //-A stops growing the queue here (~1.5 sec at 44.1 kHz)
+static const int        DEFAULT_STFT_SIZE = DEFAULT_SAMPLES;    //frames per analysis window (-n)
+static const int        MIN_STFT_SIZE = 16;
+static const int        MAX_STFT_SIZE = 65536;
+static const size_t     SEEK_READAHEAD = 1 << 20;   //bytes of audio the kernel is asked to prefetch after a seek
+static const int        DEFAULT_SCREEN_ROWS = 24;   //used when stdout isn't a terminal
+static const int        DEFAULT_SCREEN_COLS = 80;
+static const int        SCREEN_MERGE_GAP = 8;       //unchanged cells shorter than this are rewritten instead of moving the cursor
+static const int        DEFAULT_RENDER_FPS = 30;     //frame-rate cap of the render thread
+static const int        STREAM_LEAD_BLOCKS = 32;    //how far the streaming analysis may run ahead of the playhead, in blocks of DEFAULT_SAMPLES frames (~3 sec)
+static const int        MAX_ANALYSIS_WORKERS = 256;
+static const int        WORKER_CHUNK_BLOCKS = 8;    //blocks a worker takes from its own queue at a time
+static const char       CACHE_DIR_NAME[] = ".cache/terminal-music-visualizer";  //under $HOME unless -c is given
+static const char       CACHE_SUFFIX[] = ".tmva";
+static const char       CACHE_MAGIC[8] = { 'T','M','V','A','N','A','L','Y' };
+static const uint32_t   CACHE_VERSION = 6;          //bump whenever the analysis or the layout of the file changes
+static const size_t     CACHE_ALIGN = 64;           //each array of a cache file starts on a cache line
+static const long       DEFAULT_CACHE_LIMIT_MB = 256;
+static const int        CACHE_KEY_CHUNKS = 16;      //chunks of the file hashed into the cache key, spread evenly over it
+static const size_t     CACHE_KEY_CHUNK_BYTES = 4096;
+static const int        DECODE_CHUNK_FRAMES = 4096; //frames the decoder thread publishes at a time
+static const int        HIST_SUBBUCKETS = 4;        //timing histograms have 4 buckets per power of two nanoseconds
+static const int        HIST_BUCKETS = 40 * HIST_SUBBUCKETS;    //up to 2^40 ns (~18 minutes)
+static const int        STATS_SLOT_AUDIO = 0;       //every thread that records timings has a slot of its own
+static const int        STATS_SLOT_RENDER = 1;
+static const int        STATS_SLOT_STREAMING = 2;
+static const int        STATS_SLOT_WORKERS = 3;     //offline pool worker w uses STATS_SLOT_WORKERS + w
+static const int        STATS_SLOTS = STATS_SLOT_WORKERS + MAX_ANALYSIS_WORKERS;
+static const int        LEAD_SCAN_LIMIT = 4 * STREAM_LEAD_BLOCKS;  //blocks the overlay looks ahead of the playhead
+static const char       BATCH_MAGIC[8] = { 'T','M','V','B','A','T','C','H' };
+static const uint32_t   BATCH_VERSION = 4;
+static const unsigned   TRANSPORT_QUEUE_SIZE = 64;  //commands in flight between the control loop and the audio callback, power of 2
+static const int        TRANSPORT_RETRY_MS = 500;   //how long a key press waits for room in the queue before it's dropped
+static const size_t     LIVE_RING_BYTES = 1 << 20;  //raw input buffered between the source and the live analysis, power of 2
+static const int        LIVE_RESULT_SLOTS = 16;     //live mode keeps the newest blocks' results in a ring of this many
+static const int        LIVE_BACKLOG_BLOCKS = 2;    //blocks the live analysis may fall behind before it skips to the newest
+static const int        LIVE_CAPTURE_FRAMES = 1024; //capture device buffer unless -b is given
+static const size_t     LIVE_READ_BYTES = 4096;     //bytes read from stdin at a time
+static const int        LIVE_WRITE_STAMPS = 256;    //writes to the live ring whose arrival time is kept, power of 2
 
 #define __IsBigEndianMachine() (*(char*)&I == 0)
 
@@ -39,82 +103,471 @@ const int               I = 1;
 
 
 
-struct FFTW
+struct BlockRange
 {
-    fftw_complex *in;                 //used for channel data before fftw operation
-    fftw_complex *out;                //will contain real and imaginary data for left and right channel after fftw operation.
-    fftw_plan p;                 		//fftw_plan is a fftw3 data type that allocates memory for fftw
-                                  	      //read the '2.3 One-Dimensional DFTs of Real Data' section for more information:
-                                        //http://www.fftw.org/#documentation
-    double* magnitude;                 //calculating magnitude from real and imaginary parts after fftw operation. ex: sqrt(re*re+im*im);
-   	int index;
-    
+    int         begin;
+    int         end;                    //one past the last block
 };
 
-struct FFT_results
+struct AnalysisWorker                   //one thread of the offline analysis pool
 {
-    float peakfreq[SUPPORTED_CHANNELS];                    //represents the peak frequency for 2056 frame samples
-    float peakmag[SUPPORTED_CHANNELS];                     //represents the peak maximum magnitude or (amplitude) for 2056 samples 
-    double magInDB[SUPPORTED_CHANNELS][GRIDS];                    //represents the amplitude at each of the 6 frequencies thresholds.
-    size_t* raw;                                            //need to implement later
-    struct Wavform{
+    pthread_t       tid;
+    int             index;
+    struct Track*   track;              //the track the pool analyzes
+    pthread_mutex_t lock;               //guards range; held only long enough to split it
+    BlockRange      range;              //blocks still queued on this worker. The owner takes from the front,
+                                        //idle workers steal the back half
+};
 
-    	char spectrum[GRIDS][MAX_CHAR_LEN];						//Array to print out waveform on the terminal
+struct FFT_results                          //structure-of-arrays store with one entry per block; bars are drawn from it at display time
+{
+    int         blocks;
+    int         channels;
+    int         bands;
+    uint8_t*    level;                          //[block][channel][band] band magnitude in dB, LEVEL_STEPS_PER_DB steps; what the bars are drawn from
+    uint16_t*   peakmag;                        //[block][channel] peak maximum magnitude (amplitude) in dB, PEAK_STEPS_PER_DB steps
+    uint32_t*   peakfreq;                       //[block][channel] peak frequency in Hz
+    float*      feature;                        //[block][channel][FEATURES] spectral features, see Feature
+    uint8_t*    onset;                          //[block][channel] 1 when the block starts a note or a beat
+    float*      band_db;                        //[block][channel][band] band magnitude in dB as analyzed, not clamped; for -a output
+};
 
-    }wav[SUPPORTED_CHANNELS]; 
-    
-    
-    
+enum Feature                                    //what FFT_results::feature holds for every block and channel
+{
+    FEATURE_RMS,                                //level of the block in dBFS
+    FEATURE_CENTROID,                           //Hz, power weighted mean frequency
+    FEATURE_ROLLOFF,                            //Hz below which ANALYZER_ROLLOFF of the power lies
+    FEATURE_FLUX,                               //0 .. 1, the part of the spectrum that rose since the previous block
+    FEATURES
+};
+
+
+struct CacheHeader                      //start of an analysis cache file, native byte order; the arrays of FFT_results follow
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    header_size;
+    uint64_t    content_hash;           //of the file: size, mtime, inode and a few chunks of it, see file_key()
+    uint64_t    params_hash;            //of everything else the results depend on: format, rate, block size, band edges...
+    int32_t     blocks;
+    int32_t     channels;
+    int32_t     bands;
+    int32_t     reserved;
+    uint64_t    level_offset;           //from the start of the file
+    uint64_t    peakmag_offset;
+    uint64_t    peakfreq_offset;
+    uint64_t    feature_offset;
+    uint64_t    onset_offset;
+    uint64_t    band_db_offset;
+    uint64_t    file_size;
+};
+
+struct AnalysisHandoff                  //lock-free handoff between the analysis worker (single producer) and playback/display
+{
+    std::atomic<uint8_t>*   ready;      //ready[b] is stored with release order once fft_results[b] is complete
+    std::atomic<int>        produced;   //number of blocks analyzed so far
+    std::atomic<int>        seek_to;    //block the worker should continue from after a seek, -1 when nothing is pending
+    std::atomic<bool>       finished;   //set by the worker when it has stopped
+};
+
+struct PlaybackSnapshot                 //what the render thread needs to know about playback; see heard_frame()
+{
+    std::atomic<long long>  frame;      //play position of the audio last handed to the device
+    std::atomic<uint64_t>   time_ns;    //monotonic_ns() when it was handed over
+    std::atomic<long long>  latency;    //latency_frames() at that time
+    std::atomic<const struct Track*> track; //the track the frame is a position in
+    std::atomic<unsigned>   version;    //seqlock of the slot: odd while the audio callback is writing it
+};
+
+struct SnapshotBuffer                   //double buffer written by the audio callback and read by the render thread
+{
+    PlaybackSnapshot        slot[2];
+    std::atomic<unsigned>   seq;        //number of snapshots published; slot[seq & 1] is the newest
+};
+
+struct ScreenBuffer                     //frame composed in memory; only the cells that changed since the last frame are sent
+{
+    int         rows;
+    int         cols;
+    char*       cur;                    //rows*cols cells of the frame being composed
+    char*       prev;                   //rows*cols cells the terminal is showing now
+    char*       out;                    //escape codes + text of one frame, flushed with a single write()
+    size_t      out_cap;
+    int         row, col;               //where the next character goes, like a terminal cursor
+    bool        full_redraw;            //prev can't be trusted (first frame, resize or someone else printed)
+};
+
+struct WavView                          //read-only memory mapping of a RIFF/WAVE file, shared by playback and analysis
+{
+    const Uint8*    map;                //the whole file
+    size_t          map_size;
+    const Uint8*    data;               //first byte of the "data" chunk
+    uint32_t        data_size;          //size of the "data" chunk in bytes
+    SampleFormat    format;
+};
+
+struct Decoder                          //compressed input decoded in process into a PCM buffer that playback and analysis read from
+{
+    bool                    active;
+    SNDFILE*                sf;         //libsndfile: FLAC, Ogg/Vorbis, AIFF, AU, non PCM WAV...
+    mpg123_handle*          mh;         //libmpg123: MP3
+    int                     channels;
+    Uint8*                  pcm;        //anonymous mapping sized for the whole track, signed 16 bit samples, filled front to back
+    size_t                  capacity;   //bytes of pcm this track uses
+    size_t                  reserved;   //bytes mapped; the mapping is kept for the next track and only grows
+    std::atomic<size_t>     available;  //bytes of pcm decoded so far, stored with release order
+    std::atomic<bool>       done;       //set once the decoder has stopped; no more bytes will become available
+    std::atomic<bool>       stop;
+    bool                    started;
+    pthread_t               tid;
+};
+
+struct Track                            //one file of the playlist and everything loaded, decoded and analyzed for it. The player
+{                                       //has two, the one playing and the next one, and reuses them from track to track
+    const char*             filename;
+    int                     index;      //position in the playlist
+    WavView                 wavfile;    //the .WAV file mapped into memory once, or the decoder's PCM buffer
+    Decoder                 decoder;    //used when the input isn't a PCM .WAV file
+    SDL_AudioSpec           spec;       //format of the file, which is what the device is opened with
+    int                     frame_bytes;    //bytes of one sample frame in the file (all channels)
+    uint32_t                block_size;     //bytes between the starts of two analysis blocks: stft_hop frames
+    uint32_t                window_bytes;   //bytes one analysis block covers: stft_size frames
+    AnalyzerConfig          config;     //what the track's analyzers are created with: its format and the -n/-H/-W/-B/-Q options
+    std::vector<double>     band_edges;     //the default layout, or log spaced up to this file's Nyquist frequency
+    int                     blocks;     //analysis blocks of the track
+    FFT_results             fft_results;
+    AnalysisHandoff         analysis;
+    FFT_results             storage;    //the arrays fft_results uses unless it points into the cache. They only ever grow, like
+    size_t                  level_capacity; //analysis.ready, so a track no longer than the one before allocates nothing
+    size_t                  entry_capacity;
+    int                     ready_capacity;
+    char                    cache_path[1280];   //cache file of the track, set by load_analysis_cache()
+    uint64_t                cache_content;  //the two halves of its name, kept for store_analysis_cache()
+    uint64_t                cache_params;
+    void*                   cache_map;  //fft_results points into this mapping when the track was found in the cache
+    size_t                  cache_map_size;
+    bool                    streamed;   //analysis_thread() was started for it
+    std::atomic<bool>       prepared;   //set by playlist_thread() once the track is loaded, decoded and analyzed, cleared when it starts
+};
+
+enum StatStage                          //timed stages of the hot paths
+{
+    STAT_CALLBACK,                      //all of MyAudioCallback()
+    STAT_COPY,                          //copying or expanding samples into the device buffer
+    STAT_RENDER,                        //composing and writing one frame
+    STAT_FFT,                           //fftw_execute_dft_r2c() of one block
+    STAT_BLOCK,                         //analyze_block(): parse, fft and band extraction
+    STAT_PRIME,                         //prime_flux() transforming the block before a run that doesn't follow on from the last one
+    STAT_LATENCY,                       //live mode: from a block's last sample reaching the program to the frame that shows it
+    STAT_STAGES
+};
+
+struct Histogram                        //written by one thread only, read by any: relaxed loads and stores, no read-modify-write
+{
+    std::atomic<uint64_t>   count;
+    std::atomic<uint64_t>   total_ns;
+    std::atomic<uint64_t>   max_ns;
+    std::atomic<uint64_t>   bucket[HIST_BUCKETS];
+};
+
+struct ThreadStats
+{
+    Histogram   stage[STAT_STAGES];
+};
+
+struct StageSummary                     //all slots' histograms of one stage added up
+{
+    uint64_t    count;
+    uint64_t    total_ns;
+    uint64_t    max_ns;
+    uint64_t    bucket[HIST_BUCKETS];
+};
+
+struct HealthCounters                   //real-time health of playback
+{
+    uint64_t                deadline_ns;        //time one callback's worth of audio lasts: Samples / freq
+    uint64_t                last_callback_ns;   //audio thread only
+    std::atomic<uint64_t>   callbacks;
+    std::atomic<uint64_t>   deadline_misses;    //callbacks that took longer than deadline_ns
+    std::atomic<uint64_t>   late_callbacks;     //callbacks that started more than 1.5 deadlines after the previous one, or times
+                                                //the push mode queue ran dry: the device starved
+    std::atomic<uint64_t>   underruns;          //callbacks that played silence because the decoder was behind
+    std::atomic<uint64_t>   stalled_frames;     //frames drawn while the block under the playhead wasn't analyzed yet
+    std::atomic<int>        lead;               //analyzed blocks ahead of the playhead at the last frame
+    std::atomic<int>        min_lead;           //smallest lead seen while playing, -1 before the first frame
+    std::atomic<uint64_t>   dropped_blocks;     //live mode: blocks skipped so the display stays current
+    std::atomic<uint64_t>   overrun_bytes;      //live mode: input thrown away because the ring was full
+};
+
+struct BatchHeader                      //one per file in a -O bin stream, native byte order; followed by the file name
+{                                       //and then fft_results' arrays: band_db, peakmag, peakfreq, feature, onset
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    header_size;
+    uint32_t    name_length;            //bytes of the file name, no terminating 0
+    int32_t     rate;
+    int32_t     block_frames;           //frames between the starts of two blocks, the hop
+    int32_t     fft_size;               //frames each block was analyzed over
+    int32_t     window;                 //WindowType
+    int32_t     blocks;
+    int32_t     channels;
+    int32_t     bands;
+    float       peak_steps_per_db;      //PEAK_STEPS_PER_DB
+};
+
+enum TransportOp                        //what the control loop can ask of the audio callback
+{
+    TRANSPORT_PLAY,
+    TRANSPORT_PAUSE,
+    TRANSPORT_SEEK_TO,                  //frames: absolute position
+    TRANSPORT_SEEK_BY                   //frames: signed offset from the current position
+};
+
+struct TransportCommand
+{
+    TransportOp op;
+    long long   frames;
+};
+
+struct LiveFormat                       //-p names of raw sample formats
+{
+    const char*     name;
+    SampleFormat    format;
+    SDL_AudioFormat sdl_format;         //what a capture device is opened with, 0 where SDL has no such format
+    int             bytes;
+};
+
+static const LiveFormat LIVE_FORMATS[] = {
+    { "u8",    FORMAT_U8,    AUDIO_U8,     1 },
+    { "s16",   FORMAT_S16LE, AUDIO_S16LSB, 2 },
+    { "s16be", FORMAT_S16BE, AUDIO_S16MSB, 2 },
+    { "u16",   FORMAT_U16LE, AUDIO_U16LSB, 2 },
+    { "u16be", FORMAT_U16BE, AUDIO_U16MSB, 2 },
+    { "s24",   FORMAT_S24LE, 0,            3 },
+    { "s24be", FORMAT_S24BE, 0,            3 },
+    { "s32",   FORMAT_S32LE, AUDIO_S32LSB, 4 },
+    { "s32be", FORMAT_S32BE, AUDIO_S32MSB, 4 },
+    { "f32",   FORMAT_F32LE, AUDIO_F32LSB, 4 },
+    { "f32be", FORMAT_F32BE, AUDIO_F32MSB, 4 },
+};
+
+struct ByteRing                         //single producer (input), single consumer (live analysis) ring of raw PCM
+{
+    Uint8*                  data;
+    size_t                  size;       //power of 2
+    std::atomic<size_t>     head;       //bytes written so far, only the producer writes it
+    std::atomic<size_t>     tail;       //bytes consumed so far, only the consumer writes it
+    std::atomic<size_t>     stamp_end[LIVE_WRITE_STAMPS];   //head after each of the newest writes, 0 while it's being replaced,
+    std::atomic<uint64_t>   stamp_ns[LIVE_WRITE_STAMPS];    //and monotonic_ns() when it was written
+    std::atomic<size_t>     writes;     //writes so far; the newest one's stamp is at (writes-1) % LIVE_WRITE_STAMPS
+};
+
+struct LiveState                        //live mode: the newest analyzed block, published by live_analysis_thread()
+{
+    std::atomic<long long>  blocks;     //blocks analyzed so far; the newest is in result slot (blocks-1) % LIVE_RESULT_SLOTS
+    std::atomic<uint64_t>   arrival_ns[LIVE_RESULT_SLOTS];  //when the input of the block in each slot was complete
+    std::atomic<bool>       input_done; //the source ended; nothing more will be written to the ring
+    std::atomic<bool>       finished;   //set by the live analysis once the input is done and the ring is drained
 };
 
+struct TransportQueue                   //single producer (control loop), single consumer (audio callback) ring
+{
+    TransportCommand        slot[TRANSPORT_QUEUE_SIZE];
+    std::atomic<unsigned>   head;       //next slot the callback reads, only the callback writes it
+    std::atomic<unsigned>   tail;       //next slot the control loop writes, only the control loop writes it
+};
 
 struct AudioData
 {
-    Uint8*      pos;                    //pointer to the WAV data
-    Uint8*      beginning;              //pointer to the first position of the WAV data
+    const Uint8* pos;                   //pointer to the WAV data
+    const Uint8* beginning;             //pointer to the first position of the WAV data
     uint32_t    data_size;              //size of the music data in bytes
+    int         frame_bytes;            //bytes of one sample frame in the file (all channels)
     Uint32      length;                 //contains the size of music data in real time
     int32_t     SamplesFrequency;       //sample frame rate frequency for WAV file. typically 44.1k sample frames / sec (stereo)
     int32_t     Samples;                //number of buffer samples which is by default 4096. The total number of sample frames would be 4096/2
                                         //because there are 2 channels; 1 sample each for left and right channel
-    
+    bool        paused;                 //only the audio callback reads or writes pos, length and paused; see apply_transport()
 };
 
 //Global variables
 
-FFTW                        *fftw;           
-FFT_results                 *fft_results;
+std::vector<string>         playlist;               //-f, -F and FILE... in the order they are played (or analyzed with -a)
+Track                       tracks[2];              //the playing track and the next one, which playlist_thread() prepares
+std::atomic<Track*>         playing(&tracks[0]);    //switched by the audio callback on the first sample of the next track
+std::atomic<const Track*>   drawing(nullptr);       //the track render_thread() is drawing, so it isn't reused under it
+std::atomic<bool>           reopen_output(false);   //set by the audio callback when the next track needs the device in another format
+pthread_t                   playlist_tid;
+bool                        playlist_thread_started = false;
+bool                        downmix_view = false;   //draw one set of bars for all channels instead of one per channel
+int                         log_bands = 0;          //-B: number of log spaced bands, 0 keeps the default layout
+bool                        spectrum_view = false;  //-Q: log_bands bars from a weighted kernel, drawn as columns across the terminal
+int                         stft_size = DEFAULT_STFT_SIZE;  //-n: frames per fft, independent of the device buffer
+int                         stft_hop = 0;           //-H: frames between two blocks, 0 until the options are read (then stft_size)
+WindowType                  stft_window = WINDOW_RECT;  //-W
 AudioData                   audio;
-SDL_AudioSpec               wavSpec, have;                //SDL data type to analyze WAV file.
-                                                    //A structure that contains the audio output format. 
-int                         g_array_limit;           //It also contains a callback that is called when the audio device needs more data.
-int                         gc = 0;                 //global counter that increments every 4096 samples 
-bool                        time_to_exit = false;   //flag to exit thread function
-pthread_mutex_t             
-    work_mutex = PTHREAD_MUTEX_INITIALIZER;         
+SDL_AudioSpec               requested, have;        //the track format the device was opened for, and what it was opened with
+std::atomic<int>            device_frames(0);       //have.samples and have.freq, for the threads that keep running while
+std::atomic<int>            device_rate(0);         //playlist_thread() reopens the device
+SDL_AudioDeviceID           output_device = 0;      //opened by open_output(), reopened by playlist_thread() for a different format
+std::atomic<int>            gc(0);                  //first block the display can still need, derived from the play position by the audio callback
+TransportQueue              transport;              //play/pause/seek commands for the audio callback
+char*                       live_source = nullptr;  //-I: "-" for raw PCM on stdin, "capture" or "capture:NAME" for an SDL capture device
+const LiveFormat*           live_format = &LIVE_FORMATS[1];
+int                         live_rate = 44100;      //-p FORMAT:RATE:CHANNELS
+int                         live_channels = 2;
+ByteRing                    live_ring;
+LiveState                   live;
+pthread_t                   live_input_tid;
+bool                        live_input_started = false;
+std::atomic<bool>           time_to_exit(false);    //flag to exit thread function
+SnapshotBuffer              playback;               //published by MyAudioCallback(), drawn by render_thread()
+std::atomic<const char*>    status_message(nullptr);    //set by the control loop, drawn under the key list until the next key
+ScreenBuffer                screen;
+std::atomic<bool>           screen_stale(false);    //set by threads that wrote to the terminal behind the renderer's back
+int                         render_fps = DEFAULT_RENDER_FPS;
+int                         output_latency_ms = 0;  //-l: latency after the device buffer (e.g. bluetooth) the display should make up for
+int                         output_frames = 0;      //-b: device buffer in frames, 0 keeps DEFAULT_SAMPLES
+bool                        push_mode = false;      //-q: feed the device with SDL_QueueAudio() from feeder_thread() instead of a callback
+bool                        adaptive_output = false;    //-A: push mode that starts small and grows the queue whenever the device starves
+std::atomic<long long>      queue_target(0);        //push mode: frames kept queued ahead of the device
+std::atomic<long long>      queued_frames(0);       //push mode: frames that were queued when the last block was handed over
+pthread_t                   feeder_tid;
+bool                        feeder_thread_started = false;
+std::atomic<bool>           feeder_stop(false);     //set by close_output() to stop feeder_thread() before the device goes
+bool                        render_thread_started = false;
+pthread_t                   render_tid;
 const char                        vis[]= "|";          //character to print waveform
 
-char                        *filename;
+int                         analysis_workers = 0;   //threads used by the offline analysis, 0 means one per core
+AnalysisWorker*             workers;
+int                         pool_size;              //workers in the running pool
+char                        wisdom_path[1024];
+pthread_mutex_t             wisdom_mutex = PTHREAD_MUTEX_INITIALIZER;   //the next track is prepared while the playing one may be analyzed
+bool                        streaming_mode = false; //analyze while playing instead of analyzing the whole file first
+bool                        analysis_thread_started = false;
+pthread_t                   analysis_tid;
+bool                        batch_mode = false;     //-a: analyze files and write the results, no audio device and no display
+char*                       batch_output = nullptr; //-o, stdout when not given
+bool                        batch_binary = false;   //-O bin instead of csv
+bool                        cache_enabled = true;   //-C turns the analysis cache off
+ThreadStats*                stats_slots[STATS_SLOTS];   //allocated before the threads that use them start
+std::atomic<int>            stats_slots_used(0);    //readers only look at slots below this
+HealthCounters              health;
+bool                        show_stats = false;     //-S: timing overlay under the playback statistics
+char*                       stats_report = nullptr; //-R: JSON report written on exit
+char                        cache_dir[1024];
+long                        cache_limit_mb = DEFAULT_CACHE_LIMIT_MB;
 
 // Function prototypes
-void initializer_vars();
-void create_wav_graph(int); 
-void printwaveform();
-char* getfilepath();
-void file_info();                                   //uses sndfile-info program to display wav header information
-void printstats();                                  //prints the statistics of waveform after it undergoes fft. and also 
+bool initializer_vars(Track*);                      //sets up the track's fft_results; true when they were loaded from the cache
+void store_band_levels(Track*, int, int, const double*); //one channel's band levels (dB) into fft_results, as they are and quantized
+double band_level_db(const Track*, int, int, int);  //reads back a band level of (block, channel, band) in dB
+double peak_magnitude(const Track*, int, int);      //reads back the linear peak magnitude of (block, channel)
+void release_results(Track*);                       //lets go of the results but keeps the arrays for the next track
+void printwaveform(const Track*, double);           //draws the bars at a fractional block position, see block_position()
+void print_spectrum(const Track*, double);          //-Q: one column per bar or group of bars, as wide and tall as the terminal allows
+const char* wav_graph(const Track*, double, int, int); //builds the bar of '|' characters for (position, channel, band) at draw time
+double band_level_at(const Track*, double, int, int); //band level between two blocks, linearly interpolated in dB
+double downmix_level_db(const Track*, int, int);    //band level of all channels together, power averaged
+const char* channel_name(int, int);                 //short label of a channel in an SDL/WAV channel layout
+void file_info(const Track*);                       //uses sndfile-info program to display wav header information, or what mpg123 reported
+void printstats(const Track*, int, Uint32);         //prints the statistics of waveform after it undergoes fft. and also 
                                                     //control information of the audio player
-int getFileSize(FILE*);                             //returns filesize in bytes
+int map_wav_file(const char*, WavView*, SDL_AudioSpec*); //mmaps a .WAV file and fills the spec from its fmt chunk, 0 on success
+void unmap_wav_file(WavView*);
+void advise_wav_window(const Track*, const Uint8*); //asks the kernel to prefetch the audio after a seek
+int open_decoder(Decoder*, const char*, WavView*, SDL_AudioSpec*); //opens a compressed file and starts decoding it in the background, 0 on success
+void* decoder_thread(void *arg);                    //pthread function that fills a Decoder's pcm front to back
+bool bytes_decoded(const Decoder*, size_t);         //true when the first n bytes of the audio can be read
+void wait_for_decoder(const Decoder*);              //returns once the whole track has been decoded
+void close_decoder(Decoder*);
+uint64_t file_key(const char*, uint64_t);           //hash_bytes() of a file's size, mtime, inode and CACHE_KEY_CHUNKS chunks of it
 void MyAudioCallback(void*,Uint8*, int);//callback function. Its called when the audio device needs more data.
 void PressEnterToContinue();                        //function that only returns when '\n' is pressed on the keyboard. 
-void parse_wav_samples(int8_t , size_t , int&, int&);//Analyze audio wave file and extract information for fft. Splits information into 2 for left and right channels
-void analyze_data(int, int, int, FFTW);                   //Analyzes fft data for left and right channels. calculates frequencies and magnitudes 
-void PARSE_COMPUTE_ANALYZE_WAVEFILE();                                //Function that starts the WAVE analysis.  ie, calls parse_wav_samples() and analyze_data()
-void* mainthread(void *arg);                        //pthread function --NOTHING IS USING THIS THREAD FUNCTION AT THE MOMENT
+void expand_s24_to_s32(Uint8*, const Uint8*, size_t, bool); //24 bit samples are played as 32 bit
+void load_wisdom();                                 //imports fftw wisdom saved by a previous run
+void save_wisdom();                                 //exports fftw wisdom if new plans were built during this run
+uint64_t hash_bytes(const void*, size_t, uint64_t); //64 bit FNV-1a, continued from the given hash
+bool load_analysis_cache(Track*);                   //maps the cached results of this track and parameters, if there are any
+void store_analysis_cache(Track*);                  //writes the finished results to the cache directory
+void trim_analysis_cache(const char*);              //deletes the least recently used cache files beyond cache_limit_mb, except the given one
+int make_dirs(const char*);                         //mkdir -p
+void analyze_block(Track*, Analyzer*, const Uint8*, size_t, int, long long, ThreadStats*); //analyzes block (of the stream) into fft_results
+                                                    //entry cc and publishes it as ready
+void store_frame(Track*, int, const AnalyzerFrame&);    //quantizes an analyzed block into fft_results entry cc
+void prime_flux(Track*, Analyzer*, int, ThreadStats*);  //gives the analyzer the spectrum of the block before cc unless it has it
+void set_analyzer_config(Track*);                   //the track's AnalyzerConfig from its format and the options
+bool block_is_ready(const Track*, int);             //true when block b of the track's fft_results can be displayed
+size_t block_bytes(const Track*, int, const Uint8**); //where block b starts in the mapped data and how many bytes it has
+void* analysis_worker(void *arg);                   //pthread function of the offline pool: analyzes its range, then steals
+bool take_blocks(AnalysisWorker*, BlockRange&);     //takes the next chunk of the worker's own range
+bool steal_blocks(AnalysisWorker*);                 //moves half of another worker's range to this worker
+void PARSE_COMPUTE_ANALYZE_WAVEFILE(Track*);                                //Function that starts the WAVE analysis.  ie, runs the analyzer over every block
+void ANALYZE_ALL_BLOCKS(Track*);                    //runs the offline pool over the whole track and caches the results
+int pool_threads(int);                              //threads the offline pool uses for a track of this many blocks
+int BATCH_ANALYZE_FILES();                          //-a: analyzes every file and writes its results, returns the number of failures
+void write_results_csv(const Track*, FILE*, bool);  //one row per block and channel
+void write_csv_field(FILE*, const char*);           //quoted as RFC 4180 asks when it holds a comma, a quote or a line break
+bool write_results_binary(const Track*, FILE*);     //a BatchHeader and the arrays of fft_results, false on a short write
+int LIVE_ANALYZE();                                 //-I: analyzes and draws a live input until it ends or 'q' is pressed
+int parse_live_format(const char*);                 //-p "s16:44100:2", 0 on success
+bool ring_write(const Uint8*, size_t);              //appends to live_ring, all or nothing; false when it doesn't fit
+void ring_read(size_t, Uint8*, size_t);             //copies n bytes of live_ring starting at an absolute byte position
+uint64_t ring_arrival(size_t);                      //when the write that brought live_ring's head up to a byte position happened
+void live_capture_callback(void*, Uint8*, int);     //SDL capture callback: into the ring, nothing else
+void* stdin_reader_thread(void *arg);               //pthread function that moves raw PCM from stdin into the ring
+void* live_analysis_thread(void *arg);              //pthread function that analyzes the newest block of the ring
+void printlivestats(const Track*, long long, uint64_t); //the live mode header: input, counters, latency
+void draw_playback_frame(long long&);               //render thread: one frame at the playback clock's position
+void draw_live_frame(long long&);                   //render thread: one frame of the newest live block
+void START_STREAMING_ANALYSIS(Track*);              //starts analysis_thread() and returns as soon as the first block is ready
+void* analysis_thread(void *arg);                   //pthread function that keeps analysis STREAM_LEAD_BLOCKS ahead of the playhead
+void request_analysis_at(Track*, int);              //tells the streaming worker that the playhead jumped
+bool send_transport(TransportOp, long long);        //queues a command for the audio callback; false when the queue is full
+bool queue_transport(TransportOp, long long);       //control loop: send_transport(), waiting for room; reports a dropped command
+void apply_transport(AudioData*);                   //runs the queued commands at the start of a callback
+void seek_to_frame(AudioData*, long long);          //moves the play position, clamped to the track, and re-derives the block
+long long parse_position(const string&);            //"12.5" seconds or "44100f" frames, -1 if it's neither
+long long playback_frame();                         //play position as of the last callback, read from the snapshot
+long long latency_frames();                         //frames between handing audio to the device and hearing it
+long long heard_frame(const Track**);               //playback clock: the frame being heard now and its track, moves smoothly between callbacks
+double block_position(const Track*, long long);     //fractional block whose window is centred on a frame, clamped to the track
+uint64_t monotonic_ns();
+ThreadStats* stats_slot(int);                       //the slot's counters, allocated on first use; call before the thread starts
+void record_time(ThreadStats*, StatStage, uint64_t);//adds one timing to a thread's own histogram
+void summarize_stage(StatStage, StageSummary&);     //adds up a stage over every slot
+uint64_t percentile_ns(const StageSummary&, double);//upper edge of the bucket holding the given fraction of timings
+void update_lead(const Track*, int, bool);          //render thread: how far the analysis is ahead of the playhead
+void print_stats_overlay();                         //-S: one screen line per stage and the health counters
+void write_stats_report(const char*);               //-R: the same as JSON
+void release_stats();
+void fill_stream(AudioData*, Uint8*, int);          //the body of the audio callback: transport, copy, silence
+void publish_playback(const Track*, long long, uint64_t, long long); //called from the audio callback; never blocks
+unsigned read_playback(long long&, uint64_t&, long long&, const Track*&); //copies out the newest snapshot and returns its sequence number
+void* feeder_thread(void *arg);                     //push mode: keeps queue_target frames queued on the device, grows it under -A
+void* render_thread(void *arg);                     //pthread function that draws the playback clock's position or the live input, at most render_fps times a second
+void screen_begin_frame();                          //resizes the buffers if the terminal changed and blanks the new frame
+void screen_putc(char);                             //putchar() into the frame: handles '\n' and '\t', clips at the edges
+void screen_printf(const char*, ...);               //printf() into the frame
+void screen_end_frame();                            //diffs against the previous frame and writes the changes
+void screen_invalidate();                           //forces a full repaint, e.g. after printing outside the renderer; any thread
+void screen_release();
 int handle_command_line_args(int, char**);
+int read_playlist(const char*);                     //appends the files of a list (one per line, m3u style) to the playlist, 0 on success
 int INITIALIZE_SDL_AND_WAV_VARIABLES();
-void AUDIO_DEVICE_CONTROL(SDL_AudioDeviceID);
-void CLEANUPMESS(SDL_AudioDeviceID);
+int LOAD_AUDIO_FILE(Track*);                        //maps or starts decoding the track's file and fills in its format, 0 on success
+void cue_track(AudioData*, const Track*);           //points the play position at the start of a track
+void unload_track(Track*);                          //closes the track's file and lets go of its results, keeping the buffers
+void free_track(Track*);
+void* playlist_thread(void *arg);                   //pthread function that prepares every next track while the current one plays
+bool next_track(AudioData*);                        //audio callback: switches to the prepared next track if the device can play it
+bool fits_device(const Track*);                     //true when the open device plays the track's format as it is
+SDL_AudioDeviceID open_output(Track*);              //opens the device, paused, for the track's format and cues the track, 0 on failure
+void start_output();                                //starts the feeder thread in push mode and unpauses the device
+void close_output();
+void AUDIO_DEVICE_CONTROL();
+void CLEANUPMESS();
 
 
 
@@ -124,111 +577,100 @@ int main(int argc, char** argv)
 
     if(handle_command_line_args(argc, argv))
         return 1;
+    health.min_lead = -1;
+
+    if(batch_mode)
+        return BATCH_ANALYZE_FILES() == 0 ? 0 : 1;
+    if(live_source != nullptr)
+        return LIVE_ANALYZE();
 
     if(INITIALIZE_SDL_AND_WAV_VARIABLES())
         return 1;
 
-    SDL_AudioDeviceID device = SDL_OpenAudioDevice(NULL, 0, &wavSpec, &have,
-            SDL_AUDIO_ALLOW_ANY_CHANGE);
-    if(device == 0)
-    {
-        // TODO: Proper error handling
-        std::cerr << "Error: " << SDL_GetError() << std::endl;
+    Track* t = &tracks[0];
+    if(open_output(t) == 0)
         return 1;
-    }
-
-    //Update audio information if device has changed any default settings
-    if(wavSpec.format != have.format){
-		wavSpec.format = have.format;
-        cout << "wavSpec.format updated!: " << std::hex << wavSpec.format << endl;
-    }
-    if(wavSpec.samples != have.samples){
-		audio.Samples = wavSpec.samples = have.samples;
-        cout << "wavSpec.samples updated!: " << wavSpec.samples << endl;
-    }
-    if(wavSpec.freq != have.freq){
-		audio.SamplesFrequency = wavSpec.freq = have.freq;
-        cout << "wavSpec.freq updated!: " << wavSpec.freq << endl;
-    }
-    if(wavSpec.size != have.size){
-        wavSpec.size = have.size;
-        cout << "wavSpec.size updated!: " << wavSpec.size << endl;
-    }
-    PARSE_COMPUTE_ANALYZE_WAVEFILE();
-    AUDIO_DEVICE_CONTROL(device);
-    CLEANUPMESS(device);
+    stats_slot(STATS_SLOT_AUDIO);
+    stats_slot(STATS_SLOT_RENDER);
+    if(streaming_mode)
+        START_STREAMING_ANALYSIS(t);
+    else
+        PARSE_COMPUTE_ANALYZE_WAVEFILE(t);
+    AUDIO_DEVICE_CONTROL();
+    CLEANUPMESS();
   
     return 0;
 }
 
-void AUDIO_DEVICE_CONTROL(SDL_AudioDeviceID device){
-
-    //pthread_t id1;
-    //pthread_create(&id1, NULL, mainthread, NULL);
+void AUDIO_DEVICE_CONTROL(){
+
+    publish_playback(playing.load(std::memory_order_relaxed), 0, monotonic_ns(), latency_frames());
+    if(pthread_create(&render_tid, NULL, render_thread, NULL) == 0)
+        render_thread_started = true;
+    else
+        std::cerr << "Error: could not start the render thread" << std::endl;
+    //the first track was analyzed in the foreground; every later one is prepared while the one before it plays
+    if(playlist.size() > 1){
+        if(pthread_create(&playlist_tid, NULL, playlist_thread, NULL) == 0)
+            playlist_thread_started = true;
+        else
+            std::cerr << "Error: could not start the playlist thread, playing the first track only" << std::endl;
+    }
 
-    SDL_PauseAudioDevice(device, 0);
+    start_output();                                 //runs until the end; pausing and seeking go through the transport queue
   
     int c = 0;
-    int cps;        //cycles per second
-    int sec;        //seconds
-    // while (audio.length > 0){ SDL_Delay(100);}
+    string amount;
+    long long frames;
     while(c != 'q')
     {
           
             c = getchar();
+            if(c != '\n')                             //any key but the end of the line of the last one clears the message
+                status_message.store(nullptr, std::memory_order_relaxed);
+            else
+                screen_invalidate();                    //the echoed line is still on the last row and Enter scrolled the screen;
+                                                        //none of that is in prev
+            const Track* t = playing.load(std::memory_order_acquire);  //commands apply to whatever is playing when they arrive
+            long long total_frames = t->wavfile.data_size / t->frame_bytes;
             switch(c)
             {
                 case 's':
-start:               SDL_PauseAudioDevice(device, 0);
-                    //Pause = false;
+                    queue_transport(TRANSPORT_PLAY, 0);
                     break;
                 
                 case 'p':
-                    SDL_PauseAudioDevice(device, 1);
-                    //Pause = true;
+                    queue_transport(TRANSPORT_PAUSE, 0);
                     break;
                 case 'r':
-restart:            SDL_PauseAudioDevice(device, 1);
-                    //Pause = true;
-                    gc = 0;
-                    audio.pos = audio.beginning;
-                    audio.length = audio.data_size;
-                    SDL_PauseAudioDevice(device, 0);
-                    //Pause = false;
+                    advise_wav_window(t, t->wavfile.data);
+                    queue_transport(TRANSPORT_SEEK_TO, 0);
+                    queue_transport(TRANSPORT_PLAY, 0);
                     break;
-                case 'b': //b 10 ~ rewind 10 sec
-                    SDL_PauseAudioDevice(device, 1);
-                    //Pause = true;
-                    cin >> sec; 
-                    //cps = cycles per sec
-                    cps = audio.SamplesFrequency/audio.Samples; //we have frames/sec and cycles/frame. | 8192 buffer size per cycle ==> 2048 sample frames per cycle: (8192 bytes = 2 bytes (byte_size for 16 bit audio samples) X 2 channels (for stereo) X 2048 samples( or frames)), same as [2048L's + 2048R's]
-                    if((gc - sec*cps) < 0){//we want cycles given seconds
-                                                                    
-                        goto restart;
-                    }
-                    else{
-                        
-                        gc = gc - sec*cps;
-                        audio.pos-=(sec*cps*wavSpec.size); //we want bytes, so we use the fact that there are 8192 bytes per cycle 
-                        audio.length+=(sec*cps*wavSpec.size);
-                        goto start;
-                    }
+                case 'b': //b 10 ~ rewind 10 sec, b 4410f ~ rewind 4410 frames
+                    cin >> amount;
+                    if((frames = parse_position(amount)) < 0)
+                        break;
+                    //rewinding past the start restarts the song; the callback clamps
+                    advise_wav_window(t, t->wavfile.data + std::max(playback_frame() - frames, 0LL)*t->frame_bytes);
+                    queue_transport(TRANSPORT_SEEK_BY, -frames);
+                    queue_transport(TRANSPORT_PLAY, 0);
                     break;
                 case 'f':
-                    SDL_PauseAudioDevice(device, 1);
-                    cin >> sec;
-                    cps = audio.SamplesFrequency/audio.Samples;
-
-                    if((gc + sec*cps) >= g_array_limit){
-                        system("clear");
-                        printf("error: Forward past length of file. Press 'q' to quite or 'r' to restart...\n");
-                        c = getchar();
+                case 'g': //g 90 ~ go to 1:30
+                    cin >> amount;
+                    if((frames = parse_position(amount)) < 0)
+                        break;
+                    if(c == 'f')
+                        frames += playback_frame();
+                    if(frames >= total_frames){
+                        status_message.store("error: Forward past length of file. Press 'q' to quite or 'r' to restart...",
+                                             std::memory_order_relaxed);
                     }
                     else{
-                        gc = gc + sec*cps;
-                        audio.pos+=(sec*cps*wavSpec.size); //we want bytes, so we use the fact that there are 8192 bytes per cycle 
-                        audio.length-=(sec*cps*wavSpec.size);
-                        goto start;
+                        advise_wav_window(t, t->wavfile.data + frames*t->frame_bytes);
+                        queue_transport(TRANSPORT_SEEK_TO, frames);  //absolute, so frames played since we looked don't matter
+                        queue_transport(TRANSPORT_PLAY, 0);
                     }
                     break;
 
@@ -240,556 +682,2613 @@ restart:            SDL_PauseAudioDevice(device, 1);
          
     }//end while
 }
-void MyAudioCallback(void* userdata, Uint8* stream, int streamLength)
-{
-
-    AudioData* audio = (AudioData*)userdata;
-    if(audio->length == 0)
-    {
-        printstats();
-        gc = 0;
-        return;
-    }
-    else{
-        printstats();
-        printwaveform();
-        
-    }
-    
-    Uint32 length = (Uint32)streamLength;
-    length = (length > audio->length ? audio->length : length);
-
-    
-    SDL_memcpy(stream, audio->pos, length);
 
-    audio->pos += length;
-    audio->length -= length;
-    gc++;
-   
+bool queue_transport(TransportOp op, long long frames){
 
+    //the callback empties the queue every buffer, so it only stays full while the device is stalled or being reopened
+    for(int waited=0; !send_transport(op, frames); waited++){
+        if(waited >= TRANSPORT_RETRY_MS){
+            status_message.store("error: the audio device isn't taking commands, the key was dropped", std::memory_order_relaxed);
+            return false;
+        }
+        SDL_Delay(1);
+    }
+    return true;
 }
-void initializer_vars(){
 
-    int N, n_frames ;
+bool send_transport(TransportOp op, long long frames){
 
-    switch((int)SDL_AUDIO_BITSIZE(wavSpec.format)){
+    unsigned tail = transport.tail.load(std::memory_order_relaxed);
+    if(tail - transport.head.load(std::memory_order_acquire) >= TRANSPORT_QUEUE_SIZE)
+        return false;                               //the callback has stopped taking commands; nothing to wait for
+    transport.slot[tail & (TRANSPORT_QUEUE_SIZE - 1)].op = op;
+    transport.slot[tail & (TRANSPORT_QUEUE_SIZE - 1)].frames = frames;
+    transport.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
 
-            
-        case (16):   
-        
-            N = (int)(ceil((float)audio.length/(wavSpec.size)));
-            break;
-           
-    }
-    fftw = new FFTW[ wavSpec.channels ];
-    fftw[0].index = 0;
-    fftw[1].index = 1;
-    fft_results = new FFT_results[ N ];
-    g_array_limit = N;
-    n_frames = audio.Samples;
-    for(int c=0; c<wavSpec.channels; c++){
-    	fftw[c].in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * n_frames);
-    	fftw[c].out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * n_frames);
-    	fftw[c].magnitude = new double[n_frames];
+void apply_transport(AudioData* audio){
+
+    unsigned head = transport.head.load(std::memory_order_relaxed);
+    unsigned tail = transport.tail.load(std::memory_order_acquire);
+    for(; head != tail; head++){
+        const TransportCommand& cmd = transport.slot[head & (TRANSPORT_QUEUE_SIZE - 1)];
+        switch(cmd.op){
+            case TRANSPORT_PLAY:    audio->paused = false; break;
+            case TRANSPORT_PAUSE:   audio->paused = true; break;
+            case TRANSPORT_SEEK_TO: seek_to_frame(audio, cmd.frames); break;
+            case TRANSPORT_SEEK_BY: seek_to_frame(audio, (audio->pos - audio->beginning)/audio->frame_bytes + cmd.frames); break;
+        }
     }
-             
-       
+    transport.head.store(head, std::memory_order_release);
 }
 
-void parse_wav_samples(int8_t* buffer, size_t bytesRead, int* M, int* F){
-
-    int l = 0;
-    int r = 0;
-
-    if(wavSpec.channels == 2){
-	    if ((int)SDL_AUDIO_BITSIZE(wavSpec.format) == 16)
-        {
-             
-            *F = (int)bytesRead/4; /* To get number of frames divide total bytes by number of channels and bytewidth of audio data*/
-
-            fftw[0].p = fftw_plan_dft_1d(*F, fftw[0].in, fftw[0].out, FFTW_FORWARD, FFTW_MEASURE);
-            fftw[1].p = fftw_plan_dft_1d(*F, fftw[1].in, fftw[1].out, FFTW_FORWARD, FFTW_MEASURE);
-
-            for(int c=0; c<(int)bytesRead; c+=4)
+void seek_to_frame(AudioData* audio, long long frame){
+
+    Track* t = playing.load(std::memory_order_relaxed);   //only the audio callback switches tracks, and this runs on it
+    long long total = audio->data_size / audio->frame_bytes;
+    if(frame < 0)
+        frame = 0;
+    if(frame > total)
+        frame = total;
+    audio->pos = audio->beginning + frame*audio->frame_bytes;
+    audio->length = audio->data_size - (Uint32)(frame*audio->frame_bytes);
+    gc = (int)block_position(t, frame - latency_frames());
+    request_analysis_at(t, gc);
+}
 
-            { //right now assuming signed 16 bit little endian
-                
-                uint16_t temp16 = 0x0000;
+long long parse_position(const string& text){
+
+    char* end;
+    double value = strtod(text.c_str(), &end);
+    if(end == text.c_str() || value < 0)
+        return -1;
+    if(*end == 'f' && end[1] == '\0')              //frames
+        return (long long)value;
+    if(*end != '\0')
+        return -1;
+    return llround(value * playing.load(std::memory_order_acquire)->spec.freq); //seconds, to the nearest frame
+}
 
-                if(!__IsBigEndianMachine()){
+long long playback_frame(){
 
-                    if(SDL_AUDIO_ISLITTLEENDIAN(wavSpec.format)){
-                        temp16 = temp16 | (uint16_t)buffer[c];
-                        temp16 = temp16 | ((uint16_t)buffer[c+1] << 8 );  
-                                                      
-                    }
-                    else if(SDL_AUDIO_ISBIGENDIAN(wavSpec.format)){
-                        temp16 = temp16 | ((uint16_t)buffer[c] << 8);
-                        temp16 = temp16 | (uint16_t)buffer[c+1];
-                    }
+    long long frame, latency;
+    uint64_t time_ns;
+    const Track* t;
+    read_playback(frame, time_ns, latency, t);
+    return frame;
+}
 
-                    /*
-                    store first calculation in fftw[1] because Little endian machine reverses data
-                        Ex: 
-                            say that we have 16bit Data values in a file that represents Left and 
-                            Right channel respectively ---> 0x 1234 5678
-                            So Left channel data equals 1234 and Right channel data equals 5678
+long long latency_frames(){
 
-                            But Little endian machine stores values in reverse because the least 
-                            significant byte is stored in the smallest memory address:
+    //SDL plays a buffer while the callback fills the next one, and in push mode the queue is played first;
+    //SDL2 can't tell us about the rest of the output path
+    return device_frames.load(std::memory_order_relaxed) + queued_frames.load(std::memory_order_relaxed)
+         + (long long)output_latency_ms * device_rate.load(std::memory_order_relaxed) / 1000;
+}
 
-                            Little endian memory byte addresses from 0 to 4 has the data stored in 
-                            this order: 78 56 34 12 where 78 is position 0, 56 is position 1, and so on. 
+long long heard_frame(const Track** track){
+
+    long long frame, latency;
+    uint64_t time_ns;
+    read_playback(frame, time_ns, latency, *track);
+
+    //what was handed over at time_ns comes out latency frames later; until then the audio before it is playing.
+    //the clock stops at that point if no callback comes, so it never runs ahead into audio the device doesn't have.
+    //Right after a gapless switch the new track reads as its first frame until the end of the last one has been heard.
+    uint64_t now = monotonic_ns();
+    long long elapsed = now > time_ns ? (long long)((now - time_ns) * 1E-9 * (*track)->spec.freq) : 0;
+    if(elapsed > latency)
+        elapsed = latency;
+    long long heard = frame - latency + elapsed;
+    return heard < 0 ? 0 : heard;
+}
 
-                            So we can see that 78 56 data bytes represents the Right channel data values
+double block_position(const Track* t, long long frame){
 
-                            For completeness of explanation
+    //block b covers frames [b*hop, b*hop + size), so it is centred on b*hop + size/2
+    double at = (frame - stft_size/2.0) / stft_hop;
+    if(at > t->blocks - 1)
+        at = t->blocks - 1;
+    return at < 0 ? 0 : at;
+}
+void MyAudioCallback(void* userdata, Uint8* stream, int streamLength)
+{
 
-                            Big endian memory byte addresses stores data in this order: 12 34 56 78
-                    */
-                    if(SDL_AUDIO_ISSIGNED(wavSpec.format))
-                   	   fftw[1].in[r++][0] = ((int16_t)temp16)/32768.0;
-                    else
-                       fftw[1].in[r++][0] = temp16/65535.0;
+    //This runs on SDL's real-time audio thread: copy audio and publish where we are, nothing else.
+    //All drawing happens in render_thread().
+    uint64_t start = monotonic_ns();
+    if(!push_mode && health.last_callback_ns != 0 && start - health.last_callback_ns > health.deadline_ns + health.deadline_ns/2)
+        health.late_callbacks.fetch_add(1, std::memory_order_relaxed);
+    health.last_callback_ns = start;
 
-                	fftw[1].in[r-1][1] = 0.0;
-                                   
-                    
-                    temp16 = 0x0000;
-                    if(SDL_AUDIO_ISLITTLEENDIAN(wavSpec.format)){
+    fill_stream((AudioData*)userdata, stream, streamLength);
 
-                        temp16 = temp16 | (uint16_t)buffer[c+2];
-                        temp16 = temp16 | ((uint16_t)buffer[c+3] << 8 );
-                    }
-                    else if(SDL_AUDIO_ISBIGENDIAN(wavSpec.format)){
+    uint64_t spent = monotonic_ns() - start;
+    record_time(stats_slots[STATS_SLOT_AUDIO], STAT_CALLBACK, spent);
+    health.callbacks.fetch_add(1, std::memory_order_relaxed);
+    if(spent > health.deadline_ns)
+        health.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+}
 
-                        temp16 = temp16 | ((uint16_t)buffer[c+2] << 8);
-                        temp16 = temp16 | (uint16_t)buffer[c+3];
-                    }
+void fill_stream(AudioData* audio, Uint8* stream, int streamLength)
+{
+    apply_transport(audio);                         //seeks land here, one callback after they were asked for
+    if(audio->length == 0 && !audio->paused)
+        next_track(audio);                          //the last buffer ended exactly on the end of the track
+    Track* t = playing.load(std::memory_order_relaxed);
+    long long frame = (audio->pos - audio->beginning) / audio->frame_bytes;
+    //while paused or finished the snapshot is left alone, so the clock runs out to where the sound stopped
+    if((!audio->paused && audio->length != 0) || frame != playback_frame())
+        publish_playback(t, frame, monotonic_ns(), latency_frames());
+    if(audio->paused)
+    {
+        SDL_memset(stream, have.silence, streamLength);
+        return;
+    }
+    if(audio->length == 0)
+    {
+        SDL_memset(stream, have.silence, streamLength);
+        gc = 0;
+        return;
+    }
+    
+    Uint32 wanted = (Uint32)streamLength < audio->length ? (Uint32)streamLength : audio->length;
+    if(!bytes_decoded(&t->decoder, (size_t)(audio->pos - audio->beginning) + wanted))
+    {
+        SDL_memset(stream, have.silence, streamLength);   //the decoder fell behind: wait for it instead of skipping audio
+        health.underruns.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t copy_start = monotonic_ns();
+    Uint32 written = 0;                     //bytes handed to the device
+    while(written < (Uint32)streamLength && audio->length != 0){
+        Uint32 length;                      //bytes taken from the file
+        Uint32 room = (Uint32)streamLength - written;
+        if(t->wavfile.format == FORMAT_S24LE || t->wavfile.format == FORMAT_S24BE){
+            Uint32 frames = room / (4*t->spec.channels);
+            if(frames*audio->frame_bytes > audio->length)
+                frames = audio->length / audio->frame_bytes;
+            expand_s24_to_s32(stream + written, audio->pos, (size_t)frames*t->spec.channels, t->wavfile.format == FORMAT_S24BE);
+            length = frames*audio->frame_bytes;
+            written += frames*4*t->spec.channels;
+        }
+        else{
+            length = room > audio->length ? audio->length : room;
+            SDL_memcpy(stream + written, audio->pos, length);
+            written += length;
+        }
+        audio->pos += length;
+        audio->length -= length;
+        if(length == 0 || audio->length != 0 || !next_track(audio))
+            break;
+        //gapless: the next track starts on the sample after the last one of this track, in the same buffer
+        t = playing.load(std::memory_order_relaxed);
+        frame = 0;
+    }
+    if(written < (Uint32)streamLength)
+        SDL_memset(stream + written, have.silence, streamLength - written);
+    record_time(stats_slots[STATS_SLOT_AUDIO], STAT_COPY, monotonic_ns() - copy_start);
 
-                
-                    if(SDL_AUDIO_ISSIGNED(wavSpec.format))
-                    	fftw[0].in[l++][0] = ((int16_t)temp16)/32768.0;
-                    else
-                        fftw[0].in[l++][0] = temp16/65535.0;
+    gc = (int)block_position(t, frame - latency_frames());   //what the display shows until the next callback starts here
+   
 
-                	fftw[0].in[l-1][1] = 0.0;
-                }	                        
-                
+}
 
-//other formats can be implemented
-                //----------------------------------------------
-            
-                
-    
-            }//end for
-            
-            
-           
-	    }//end if
-	}
+bool next_track(AudioData* audio){
 
+    Track* current = playing.load(std::memory_order_relaxed);
+    Track* next = current == &tracks[0] ? &tracks[1] : &tracks[0];
+    if(!next->prepared.load(std::memory_order_acquire))
+        return false;                               //the end of the playlist, or the next track isn't ready yet
+    if(!fits_device(next)){
+        reopen_output.store(true, std::memory_order_release);  //playlist_thread() reopens the device; until then this plays silence
+        return false;
+    }
+    next->prepared.store(false, std::memory_order_relaxed);
+    cue_track(audio, next);
+    playing.store(next, std::memory_order_release);
+    return true;
 }
 
-void analyze_data(int M, int F, int cc, FFTW fftw){
+bool fits_device(const Track* t){
 
+    return t->spec.freq == requested.freq && t->spec.format == requested.format && t->spec.channels == requested.channels;
+}
 
-    double max[5] = {  
-            1.7E-308,
-            1.7E-308,
-            1.7E-308,
-            1.7E-308,
-            1.7E-308
-    };
-
-    double re, im; 
-    double peakmax = 1.7E-308 ;
-    int max_index = -1;
+void* feeder_thread(void *arg){
+
+    SDL_AudioDeviceID device = (SDL_AudioDeviceID)(uintptr_t)arg;
+    int device_frame_bytes = have.size / have.samples;
+    Uint8* chunk = new Uint8[have.size];
+    Uint32 poll_ms = have.samples * 1000 / have.freq / 4;     //a quarter of a device buffer
+    bool primed = false;                            //an empty queue before anything was queued isn't a glitch
+
+    //the same work the callback does, on a thread of our own: the device only ever pulls from the queue
+    while(!time_to_exit && !feeder_stop.load(std::memory_order_relaxed)){
+        long long queued = SDL_GetQueuedAudioSize(device) / device_frame_bytes;
+        if(queued == 0 && primed){
+            health.late_callbacks.fetch_add(1, std::memory_order_relaxed);
+            long long target = queue_target.load(std::memory_order_relaxed);
+            if(adaptive_output && target < MAX_QUEUE_FRAMES)
+                queue_target.store(target*2, std::memory_order_relaxed);   //only ever grows: the lowest depth that holds
+        }
+        if(queued < queue_target.load(std::memory_order_relaxed)){
+            queued_frames.store(queued, std::memory_order_relaxed);
+            MyAudioCallback(&audio, chunk, have.size);
+            SDL_QueueAudio(device, chunk, have.size);
+            primed = true;
+            continue;
+        }
+        SDL_Delay(poll_ms > 0 ? poll_ms : 1);
+    }
 
+    delete [] chunk;
+    pthread_exit(NULL);
+}
 
-    for (int m=0 ; m< F/2; m++){  
-        re = fftw.out[m][0];
-        im = fftw.out[m][1];
-      
-        fftw.magnitude[m] = sqrt(re*re+im*im);
-        
-        float freq = m * (float)wavSpec.freq / F;
+void publish_playback(const Track* t, long long frame, uint64_t time_ns, long long latency){
+
+    //write the slot the reader isn't looking at, then flip to it. A reader that is still in it from two
+    //snapshots ago sees its version change and reads again
+    unsigned next = playback.seq.load(std::memory_order_relaxed) + 1;
+    PlaybackSnapshot& s = playback.slot[next & 1];
+    unsigned version = s.version.load(std::memory_order_relaxed);
+    s.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);   //the odd version is visible before any of the new values
+    s.frame.store(frame, std::memory_order_relaxed);
+    s.time_ns.store(time_ns, std::memory_order_relaxed);
+    s.latency.store(latency, std::memory_order_relaxed);
+    s.track.store(t, std::memory_order_relaxed);
+    s.version.store(version + 2, std::memory_order_release);
+    playback.seq.store(next, std::memory_order_release);
+}
 
-        if(freq > 19 && freq<= 140){ 
-            if(fftw.magnitude[m] > max[0]){ 
-                max[0] = fftw.magnitude[m];
-            }
-        }
-        else if(freq > 140 && freq<= 400){
-            if(fftw.magnitude[m] > max[1]){ 
-                max[1] = fftw.magnitude[m];
-            }
-        }
-        else if(freq >400 && freq<= 2600){
-            if(fftw.magnitude[m] > max[2]){ 
-                max[2] = fftw.magnitude[m];
-            }
-        }
-        else if(freq > 2600 && freq<= 5200){
-            if(fftw.magnitude[m] > max[3]){ 
-                max[3] = fftw.magnitude[m];
-            }
-        }
-        else if(freq > 5200 && freq<= audio.SamplesFrequency/2){
-            if(fftw.magnitude[m] > max[4]){ 
-                max[4] = fftw.magnitude[m];
-            }
+unsigned read_playback(long long& frame, uint64_t& time_ns, long long& latency, const Track*& track){
+
+    unsigned seq, before, after;
+    do{
+        seq = playback.seq.load(std::memory_order_acquire);
+        const PlaybackSnapshot& s = playback.slot[seq & 1];
+        before = s.version.load(std::memory_order_acquire);
+        frame = s.frame.load(std::memory_order_relaxed);
+        time_ns = s.time_ns.load(std::memory_order_relaxed);
+        latency = s.latency.load(std::memory_order_relaxed);
+        track = s.track.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = s.version.load(std::memory_order_relaxed);
+    }while((before & 1) != 0 || before != after);  //the writer came around to our slot while we read it
+
+    return seq;
+}
+bool initializer_vars(Track* t){
+
+    int N;
+
+    N = (int)((t->wavfile.data_size + t->block_size - 1)/t->block_size);  //every block that starts inside the track
+    t->fft_results.blocks = N;
+    t->fft_results.channels = t->spec.channels;
+    t->band_edges.resize((log_bands > 0 ? log_bands : ANALYZER_DEFAULT_BANDS) + 1);
+    t->fft_results.bands = analyzer_make_band_edges(t->spec.freq, log_bands, t->band_edges.data());
+    t->blocks = N;
+
+    bool cached = load_analysis_cache(t);
+    if(!cached){
+        //a track no longer than the ones before it reuses their arrays; analyze_block() writes every entry before it is ready
+        size_t entries = (size_t)N * t->spec.channels;
+        size_t levels = entries * t->fft_results.bands;
+        if(levels > t->level_capacity){
+            delete [] t->storage.level;
+            delete [] t->storage.band_db;
+            t->storage.level = new uint8_t[levels]();
+            t->storage.band_db = new float[levels]();
+            t->level_capacity = levels;
         }
-        if(fftw.magnitude[m] > peakmax){ 
-            peakmax = fftw.magnitude[m];
-            max_index = m;
+        if(entries > t->entry_capacity){
+            delete [] t->storage.peakmag;
+            delete [] t->storage.peakfreq;
+            delete [] t->storage.feature;
+            delete [] t->storage.onset;
+            t->storage.peakmag = new uint16_t[entries]();
+            t->storage.peakfreq = new uint32_t[entries]();
+            t->storage.feature = new float[entries * FEATURES]();
+            t->storage.onset = new uint8_t[entries]();
+            t->entry_capacity = entries;
         }
-    }//end for
+        t->fft_results.level = t->storage.level;
+        t->fft_results.peakmag = t->storage.peakmag;
+        t->fft_results.peakfreq = t->storage.peakfreq;
+        t->fft_results.feature = t->storage.feature;
+        t->fft_results.onset = t->storage.onset;
+        t->fft_results.band_db = t->storage.band_db;
+    }
+    if(N > t->ready_capacity){
+        delete [] t->analysis.ready;
+        t->analysis.ready = new std::atomic<uint8_t>[ N ];
+        t->ready_capacity = N;
+    }
+    for(int b=0; b<N; b++)
+        t->analysis.ready[b].store(cached, std::memory_order_relaxed);
+    t->analysis.produced = cached ? N : 0;
+    t->analysis.seek_to = -1;
+    t->analysis.finished = cached;
+    return cached;
+}
 
-    if(fftw.index == 0){
-    		fft_results[cc].peakfreq[0] = max_index*wavSpec.freq/F;
-    		fft_results[cc].peakmag[0] = peakmax;
-    	}
-    	else if(wavSpec.channels > 1){
-    	fft_results[cc].peakfreq[fftw.index] = max_index*wavSpec.freq/F;
-    	fft_results[cc].peakmag[fftw.index] = peakmax;
-    	}
+void expand_s24_to_s32(Uint8* dst, const Uint8* src, size_t samples, bool big_endian){
 
+    //SDL has no 24 bit format, so those files are played as 32 bit: the sample goes in the top three bytes
+    Sint32* out = (Sint32*)dst;
+    for(size_t i=0; i<samples; i++, src += 3){
+        uint32_t v = big_endian ? (uint32_t)src[2] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[0] << 24
+                                : (uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 24;
+        out[i] = (Sint32)v;
+    }
+}
 
+void set_analyzer_config(Track* t){
+
+    AnalyzerConfig* c = &t->config;
+    c->rate = t->spec.freq;
+    c->channels = t->spec.channels;
+    c->format = t->wavfile.format;
+    c->fft_size = stft_size;                        //every block is transformed at the same size, so there is only one plan
+    c->hop = stft_hop;
+    c->window = stft_window;
+    c->bands = log_bands;
+    c->weighted = spectrum_view;
+    c->queue = 0;                                   //blocks are analyzed straight out of the mapped file with analyzer_block()
+}
 
+void analyze_block(Track* t, Analyzer* analyzer, const Uint8* buffer, size_t bytesRead, int cc, long long block, ThreadStats* stats){
 
-    for(int copy=0; copy < GRIDS; copy++){
+    AnalyzerFrame frame;
+    uint64_t start = monotonic_ns();
 
-    	if(fftw.index == 0)
-        	fft_results[cc].magInDB[0][copy] = 10*(log10(max[copy]));
-        else if(wavSpec.channels > 1)
-        	fft_results[cc].magInDB[fftw.index][copy] = 10*(log10(max[copy]));
+    analyzer_load(analyzer, buffer, bytesRead);
+    uint64_t fft_start = monotonic_ns();
+    analyzer_transform(analyzer);
+    record_time(stats, STAT_FFT, monotonic_ns() - fft_start);
+    analyzer_extract(analyzer, block, &frame);
+    store_frame(t, cc, frame);
+    record_time(stats, STAT_BLOCK, monotonic_ns() - start);
 
-    }
+    t->analysis.ready[cc].store(1, std::memory_order_release);   //results must be visible before the flag
+    t->analysis.produced.fetch_add(1, std::memory_order_relaxed);
+}
 
+void store_frame(Track* t, int cc, const AnalyzerFrame& frame){
+
+    for(int c=0; c<frame.channels; c++){
+        size_t entry = (size_t)cc*t->fft_results.channels + c;
+        double peakdB = frame.peak_db[c]*PEAK_STEPS_PER_DB;
+        double peakfreq = frame.peak_hz[c];
+        const AnalyzerFeatures& f = frame.features[c];
+        float* feature = t->fft_results.feature + entry*FEATURES;
+
+        t->fft_results.peakfreq[entry] = (uint32_t)(peakfreq <= 0 ? 0 : peakfreq >= UINT32_MAX ? UINT32_MAX : peakfreq);
+        t->fft_results.peakmag[entry] = (uint16_t)(peakdB <= 0 ? 0 : peakdB >= UINT16_MAX ? UINT16_MAX : peakdB + 0.5);
+        store_band_levels(t, cc, c, frame.level + (size_t)c*frame.bands);
+        feature[FEATURE_RMS] = (float)f.rms_db;
+        feature[FEATURE_CENTROID] = (float)f.centroid_hz;
+        feature[FEATURE_ROLLOFF] = (float)f.rolloff_hz;
+        feature[FEATURE_FLUX] = (float)f.flux;
+        t->fft_results.onset[entry] = f.onset;
+    }
+}
 
+void prime_flux(Track* t, Analyzer* analyzer, int cc, ThreadStats* stats){
+
+    //the flux of a block is measured against the one before it. A worker takes its own range from the front, so its
+    //runs follow on from each other and only its first run and every stolen one cost an extra fft here: pool size - 1
+    //plus the steals per track, counted as "prime" by -S and -R. The streaming thread only pays after a seek
+    const Uint8* buffer;
+    if(cc > 0 && analyzer_previous_block(analyzer) != cc - 1){
+        uint64_t start = monotonic_ns();
+        size_t bytesRead = block_bytes(t, cc - 1, &buffer);
+        analyzer_prime(analyzer, buffer, bytesRead, cc - 1);
+        record_time(stats, STAT_PRIME, monotonic_ns() - start);
+    }
+}
 
+bool block_is_ready(const Track* t, int b){
 
+    if(b < 0 || b >= t->blocks)
+        return false;
+    return t->analysis.ready[b].load(std::memory_order_acquire) != 0;
 }
-void PARSE_COMPUTE_ANALYZE_WAVEFILE(){
 
- 
-
-    size_t bytesRead;
-   
-    uint32_t BUFFER_SIZE = wavSpec.size;
-    int8_t* buffer ;   
-    int M;
-    int F; // used for number of frames
+size_t block_bytes(const Track* t, int b, const Uint8** start){
 
-    
-    int cc=0;
-   
-    FILE* wavFile = fopen(filename, "r");
-    int filesize = getFileSize(wavFile);
+    size_t offset = (size_t)b*t->block_size;
+    if(offset >= t->wavfile.data_size){
+        *start = t->wavfile.data;                   //nothing to read, but never a stale pointer
+        return 0;
+    }
+    *start = t->wavfile.data + offset;
+    return t->wavfile.data_size - offset < t->window_bytes ? t->wavfile.data_size - offset : t->window_bytes;
+}
 
-    initializer_vars();
+void PARSE_COMPUTE_ANALYZE_WAVEFILE(Track* t){
 
-    buffer = new int8_t[BUFFER_SIZE];
-    bytesRead = fread(buffer, sizeof buffer[0], filesize-audio.data_size, wavFile); //Skip header information in .WAV file
+ 
 
-    while ((bytesRead = fread(buffer, sizeof buffer[0], BUFFER_SIZE / (sizeof buffer[0]), wavFile)) > 0) //Reading actual audio data
-    {
-        parse_wav_samples(buffer, bytesRead, &M, &F);
+    if(!initializer_vars(t))                        //otherwise it was analyzed in an earlier run
+        ANALYZE_ALL_BLOCKS(t);
+  
+    file_info(t);
+}
 
-        for(int c=0; c< wavSpec.channels; ++c)
-        	fftw_execute(fftw[c].p);
+int pool_threads(int blocks){
 
-        for(int c=0; c< wavSpec.channels; ++c)
-        	analyze_data(M, F, cc, fftw[c]);
-                
-   		create_wav_graph(cc);
+    int count = analysis_workers > 0 ? analysis_workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(count < 1)
+        count = 1;
+    if(count > MAX_ANALYSIS_WORKERS)
+        count = MAX_ANALYSIS_WORKERS;
+    if(count > blocks)
+        count = blocks > 0 ? blocks : 1;
+    return count;
+}
 
-   		for(int c=0; c< wavSpec.channels; ++c)
-	        fftw_destroy_plan(fftw[c].p);
+void ANALYZE_ALL_BLOCKS(Track* t){
 
-        
-        cc++;     
-         
-    }//end while(fread)
+    wait_for_decoder(&t->decoder);                  //the workers read all over the track
+    load_wisdom();
 
-    delete [] buffer;
-    delete [] fftw[0].magnitude;
-    delete [] fftw[1].magnitude;
-    buffer = nullptr;
+    int count = pool_threads(t->blocks);
 
-    fftw_free(fftw[0].in); 
-    fftw_free(fftw[1].in);
-    fftw_free(fftw[0].out);
-	fftw_free(fftw[1].out);
-	delete [] fftw;
-	fftw = nullptr;
+    //every worker starts with an equal slice of the file; whoever runs dry steals from the others
+    workers = new AnalysisWorker[count];
+    for(int w=0; w<count; w++){
+        workers[w].index = w;
+        workers[w].track = t;
+        stats_slot(STATS_SLOT_WORKERS + w);
+        pthread_mutex_init(&workers[w].lock, NULL);
+        workers[w].range.begin = (int)((long long)t->blocks*w/count);
+        workers[w].range.end = (int)((long long)t->blocks*(w+1)/count);
+    }
+    pool_size = count;
 
-    fclose(wavFile);
-  
-    file_info();
+    int started = 0;
+    for(int w=1; w<count; w++){
+        if(pthread_create(&workers[w].tid, NULL, analysis_worker, &workers[w]) != 0)
+            break;                                  //the threads we did get will steal the missing ones' blocks
+        started++;
+    }
+    analysis_worker(&workers[0]);                   //the main thread works too
+    for(int w=1; w<=started; w++)
+        pthread_join(workers[w].tid, NULL);
+
+    for(int w=0; w<count; w++)
+        pthread_mutex_destroy(&workers[w].lock);
+    delete [] workers;
+    workers = nullptr;
+
+    save_wisdom();
+    if(t->analysis.produced.load(std::memory_order_relaxed) == t->blocks && !time_to_exit)
+        store_analysis_cache(t);                    //the pool stops early when the program is quitting
 }
 
-// find the file size 
-int getFileSize(FILE *inFile){
-    int fileSize = 0;
-    fseek(inFile,0,SEEK_END);
-
-    fileSize=ftell(inFile);
+void* analysis_worker(void *arg){
+
+    AnalysisWorker* self = (AnalysisWorker*)arg;
+    BlockRange r;
+    const Uint8* buffer;                            //points straight into the mapped file, nothing is copied
+
+    Track* t = self->track;
+    ThreadStats* stats = stats_slots[STATS_SLOT_WORKERS + self->index];
+    Analyzer* analyzer = analyzer_create(&t->config, NULL); //every worker has its own; plans and band layouts are shared
+    if(analyzer == NULL)
+        return NULL;                                //the other workers steal its blocks
+    do{
+        while(!time_to_exit && take_blocks(self, r)){
+            prime_flux(t, analyzer, r.begin, stats);
+            for(int cc=r.begin; cc<r.end; cc++){
+                size_t bytesRead = block_bytes(t, cc, &buffer);
+                analyze_block(t, analyzer, buffer, bytesRead, cc, cc, stats);
+            }
+        }
+    }while(!time_to_exit && steal_blocks(self));
+    analyzer_destroy(analyzer);
 
-    fseek(inFile,0,SEEK_SET);
-    return fileSize;
+    return NULL;
 }
 
-void PressEnterToContinue()
-{
-  std::cout << "Press ENTER to continue... " << flush;
-  std::cin.ignore( std::numeric_limits <std::streamsize> ::max(), '\n' );
-  std::system("clear");
-}
+bool take_blocks(AnalysisWorker* self, BlockRange& r){
 
-void* mainthread(void *arg){
+    pthread_mutex_lock(&self->lock);
+    r.begin = self->range.begin;
+    r.end = self->range.end - r.begin > WORKER_CHUNK_BLOCKS ? r.begin + WORKER_CHUNK_BLOCKS : self->range.end;
+    self->range.begin = r.end;
+    pthread_mutex_unlock(&self->lock);
 
-    while(!time_to_exit) 
-        {
-             
-               // while(!Pause && (audio.length > 0) && !time_to_exit){} //gonna be used for opengl 3.x
+    return r.begin < r.end;
+}
 
+bool steal_blocks(AnalysisWorker* self){
+
+    //blocks are never handed back, so one pass that finds every queue empty means the analysis is done
+    for(int i=1; i<pool_size; i++){
+        AnalysisWorker* victim = &workers[(self->index + i) % pool_size];
+        BlockRange loot;
+
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->range.end - victim->range.begin;
+        loot.end = victim->range.end;
+        loot.begin = loot.end - (left + 1)/2;
+        victim->range.end = loot.begin;
+        pthread_mutex_unlock(&victim->lock);
+
+        if(loot.begin < loot.end){
+            pthread_mutex_lock(&self->lock);        //others may steal it back from us while we work on it
+            self->range = loot;
+            pthread_mutex_unlock(&self->lock);
+            return true;
         }
-
-    pthread_exit(NULL);
+    }
+    return false;
 }
 
+void START_STREAMING_ANALYSIS(Track* t){
 
-void printstats(){
- 
-    std::system("clear");
-    printf("%s%s", "FILE_PATH : ",filename);
-    putchar('\n');
-    putchar('\n');
-    printf( "Press: \np to pause \ns to start \nr to restart\nq to quit\nb <sec> to rewind song in sec\nf <sec> to fast forward in sec" );
-    putchar('\n');
-    putchar('\n');
-   
-    printf("%s%d", "Sample Rate : ", audio.SamplesFrequency );
-    putchar('\n');
-   
-    printf("%s%d", "Frames (samples) per Period : ", audio.Samples);
-    putchar('\n');
-    
-    double val = audio.length/wavSpec.channels;
-    
-    if (SDL_AUDIO_BITSIZE(wavSpec.format) == 16) 
-        val = val / 2; 
+    bool cached = initializer_vars(t);
+    file_info(t);
+    if(cached)                                      //nothing left to analyze
+        return;
+    load_wisdom();
 
-    val = val / audio.SamplesFrequency ;
+    stats_slot(STATS_SLOT_STREAMING);
+    if(pthread_create(&analysis_tid, NULL, analysis_thread, t) != 0){
+        std::cerr << "Error: could not start the analysis thread, analyzing the whole file first" << std::endl;
+        streaming_mode = false;
+        ANALYZE_ALL_BLOCKS(t);                      //initializer_vars() already set everything up
+        return;
+    }
+    analysis_thread_started = true;
+    t->streamed = true;
 
-  /* val is in seconds ===>   X [bytes]    frame        channel      sec 
-                             --------- * ----------  * ------- * -------------
-                                 1       2 channels    2 bytes   44.1k frames  */
+    //playback can start as soon as the block under the playhead has been analyzed
+    while(!block_is_ready(t, 0) && !t->analysis.finished)
+        SDL_Delay(1);
+}
 
-    printf("%s%.02lf", "TIME Remaining (sec) : ", val);
-    putchar('\n');
+void* analysis_thread(void *arg){
+
+    Track* t = (Track*)arg;
+    const Uint8* buffer;
+    int cursor = 0;                                 //next block the worker will look at
+    //the lead is kept in time, not blocks: a small hop makes many more blocks per second
+    int lead_blocks = std::max(STREAM_LEAD_BLOCKS, (int)((long long)STREAM_LEAD_BLOCKS*DEFAULT_SAMPLES/stft_hop));
+
+    ThreadStats* stats = stats_slots[STATS_SLOT_STREAMING];
+    Analyzer* analyzer = analyzer_create(&t->config, NULL);
+    //the playhead is only this track's until the next one starts; later tracks are analyzed whole, ahead of time
+    while(analyzer != NULL && !time_to_exit && playing.load(std::memory_order_acquire) == t){
+
+        int seek = t->analysis.seek_to.exchange(-1, std::memory_order_acq_rel);
+        if(seek >= 0)
+            cursor = seek;                          //re-prioritize around the new playhead position
+
+        int playhead = gc.load(std::memory_order_relaxed);
+        if(cursor < playhead)
+            cursor = playhead;                      //never spend time on blocks that were already played
+        while(cursor < t->blocks && block_is_ready(t, cursor))
+            cursor++;
+        if(cursor < t->blocks && !bytes_decoded(&t->decoder, (size_t)cursor*t->block_size + t->window_bytes)){
+            SDL_Delay(2);                           //the decoder hasn't got there yet
+            continue;
+        }
 
-    if(wavSpec.channels == 2){
-        float AvgdBPeakMag = 10*log10((fft_results[gc].peakmag[0] + fft_results[gc].peakmag[1])/2);
-        printf("%s%.2lf", "peak Magn. (dB)\t: ", AvgdBPeakMag > 0 ? AvgdBPeakMag : 0);
-    }
-    
-    else{
-        float dBPeakMag = 10*log10((fft_results[gc].peakmag[0]));
-        printf("%s%.2lf", "peak Magn. (dB)\t: ", dBPeakMag > 0 ? dBPeakMag : 0);
+        if(cursor >= t->blocks || cursor - playhead >= lead_blocks){
+            if(t->analysis.produced.load(std::memory_order_relaxed) == t->blocks)
+                break;                              //every block is done, nothing can be asked of us anymore
+            SDL_Delay(2);                           //far enough ahead, wait for the playhead to move
+            continue;
+        }
+
+        size_t bytesRead = block_bytes(t, cursor, &buffer);
+        if(bytesRead == 0)
+            break;
+        prime_flux(t, analyzer, cursor, stats);
+        analyze_block(t, analyzer, buffer, bytesRead, cursor, cursor, stats);
+        cursor++;
     }
-    putchar('\n');
-    
-    printf( "=============================================================\n");
 
+    analyzer_destroy(analyzer);
+    if(t->analysis.produced.load(std::memory_order_relaxed) == t->blocks)
+        store_analysis_cache(t);                    //only complete results are worth keeping
+    t->analysis.finished = true;
+
+    pthread_exit(NULL);
 }
 
-void file_info()
-{
-  
-    system("clear");
-    char CMD[] = "sndfile-info ";
-    char buffer[128];
+void request_analysis_at(Track* t, int block){
 
+    if(t->streamed)
+        t->analysis.seek_to.store(block, std::memory_order_release);
+}
 
-    snprintf(buffer, 128, "%s %s", CMD,filename);
-    system(buffer);
+void load_wisdom(){
 
-    PressEnterToContinue();
+    pthread_mutex_lock(&wisdom_mutex);
+    if(wisdom_path[0] == '\0'){
+        const char* home = getenv("HOME");
+        if(home != NULL)
+            snprintf(wisdom_path, sizeof(wisdom_path), "%s/%s", home, WISDOM_FILE_NAME);
+    }
+    if(wisdom_path[0] != '\0')
+        analyzer_import_wisdom(wisdom_path);
+    pthread_mutex_unlock(&wisdom_mutex);
 }
 
-void create_wav_graph(int cc){
+void save_wisdom(){
 
+    pthread_mutex_lock(&wisdom_mutex);
+    if(wisdom_path[0] != '\0' && !analyzer_export_wisdom(wisdom_path))
+        std::cerr << "Warning: could not save fftw wisdom to " << wisdom_path << std::endl;
+    pthread_mutex_unlock(&wisdom_mutex);
+}
 
-			for(int g=0; g<GRIDS; ++g){
-				for (int c = 0; c < wavSpec.channels; ++c){
-					strcpy(fft_results[cc].wav[c].spectrum[g], "");
-				}
-			}
+static uint16_t read_u16(const Uint8* p, bool big_endian){
 
-          for(int chs=0; chs<wavSpec.channels; chs++){
-            	for(int g=0; g<GRIDS; g++){
-            		for(int A=0; A<fft_results[cc].magInDB[chs][g]; A+=CHAR_THRESHOLD){
-                        strcat (fft_results[cc].wav[chs].spectrum[g],vis);
-    
-                	}
-              	}
-            }
+    return big_endian ? (uint16_t)(p[0] << 8 | p[1]) : (uint16_t)(p[1] << 8 | p[0]);
+}
 
-     
+static uint32_t read_u32(const Uint8* p, bool big_endian){
 
+    return big_endian ? (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]
+                      : (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
 }
-void printwaveform(){
-		for(int c=0; c< wavSpec.channels; c++){
-			for(int out=0; out<GRIDS; out++){
-				if(c==0){
-					cout << "L" << out << fft_results[gc].wav[c].spectrum[out] << endl;
-					cout << "L" << out << fft_results[gc].wav[c].spectrum[out] << endl;
-				}
-				else{
-					cout << "R" << GRIDS-1-out << fft_results[gc].wav[c].spectrum[GRIDS-1-out] << endl;
-					cout << "R" << GRIDS-1-out << fft_results[gc].wav[c].spectrum[GRIDS-1-out] << endl;
 
-				}
-			}
-	        cout << "\n\n\n";
-		}
-		
-		
+int map_wav_file(const char* path, WavView* view, SDL_AudioSpec* spec){
 
- }
+    memset(view, 0, sizeof(*view));
 
-char path[1024];
-char* getfilepath(){
-
-	system("clear");
-	char buffer[1024];
-	FILE *fp;
-  	
-    cout << "getfilepath()" << endl;
-  	snprintf(buffer, 1024, " avconv -i %s -f wav temp.wav",filename); //convert mp3 to wav file
-  	system(buffer);
-    /* Open the command for reading. */
-    fp = popen("pwd", "r"); //get current/working directory
-    if (fp == NULL) {
-     printf("Failed to run command\n" );
-     return NULL;
-    }
-
-	  /*get terminal output and find null character position.  This position is the start of concatenation of temporary file name*/
-	  fgets(path, sizeof(path), fp); 
-	  int c=0;
-	  while(path[c] != '\0'){c++;} //
-  
-	  c--; //move position to the newline character of string (very end before null character)
-	  char t[] = "/temp.wav";
-	  //copy chars from t array and append to path array 
-	  for(int i=0; i<= (int)sizeof(t); i++){
-	  	path[c+i]= t[i]; 
-	  }
-	  /* close */
-	  pclose(fp);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return 1;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 12){
+        close(fd);
+        return 1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                                      //the mapping keeps the file alive
+    if(map == MAP_FAILED)
+        return 1;
+    view->map = (const Uint8*)map;
+    view->map_size = st.st_size;
+
+    /*
+        RIFF/WAVE layout:  "RIFF" <size> "WAVE" followed by chunks of  <id> <size> <payload, padded to even size>
+        "RIFX" files are the same with big endian numbers and samples.
+    */
+    const Uint8* p = view->map;
+    const Uint8* end = view->map + view->map_size;
+    bool big_endian = memcmp(p, "RIFX", 4) == 0;
+    if((!big_endian && memcmp(p, "RIFF", 4) != 0) || memcmp(p + 8, "WAVE", 4) != 0){
+        unmap_wav_file(view);
+        return 1;
+    }
+
+    uint16_t tag = 0, channels = 0, bits = 0;
+    uint32_t freq = 0;
+    for(p += 12; p + 8 <= end; ){
+        uint32_t size = read_u32(p + 4, big_endian);
+        const Uint8* payload = p + 8;
+        uint32_t available = (uint32_t)(end - payload);
+
+        if(memcmp(p, "fmt ", 4) == 0 && size >= 16 && available >= 16){
+            tag = read_u16(payload, big_endian);
+            channels = read_u16(payload + 2, big_endian);
+            freq = read_u32(payload + 4, big_endian);
+            bits = read_u16(payload + 14, big_endian);
+            if(tag == 0xFFFE && size >= 40 && available >= 40)   //WAVE_FORMAT_EXTENSIBLE: the real tag starts the SubFormat GUID
+                tag = read_u16(payload + 24, big_endian);
+        }
+        else if(memcmp(p, "data", 4) == 0){
+            view->data = payload;
+            view->data_size = size < available ? size : available; //tolerate truncated files and streaming headers
+            break;
+        }
+        if(size >= available)
+            break;
+        p = payload + size + (size & 1);
+    }
+
+    SDL_AudioFormat format = 0;
+    view->format = FORMAT_UNKNOWN;
+    if(tag == 1 && bits == 8){
+        format = AUDIO_U8;
+        view->format = FORMAT_U8;
+    }
+    else if(tag == 1 && bits == 16){
+        format = big_endian ? AUDIO_S16MSB : AUDIO_S16LSB;
+        view->format = big_endian ? FORMAT_S16BE : FORMAT_S16LE;
+    }
+    else if(tag == 1 && bits == 24){
+        format = AUDIO_S32SYS;                      //played through expand_s24_to_s32()
+        view->format = big_endian ? FORMAT_S24BE : FORMAT_S24LE;
+    }
+    else if(tag == 1 && bits == 32){
+        format = big_endian ? AUDIO_S32MSB : AUDIO_S32LSB;
+        view->format = big_endian ? FORMAT_S32BE : FORMAT_S32LE;
+    }
+    else if(tag == 3 && bits == 32){
+        format = big_endian ? AUDIO_F32MSB : AUDIO_F32LSB;
+        view->format = big_endian ? FORMAT_F32BE : FORMAT_F32LE;
+    }
+
+    if(view->data == NULL || format == 0 || channels == 0 || freq == 0){
+        unmap_wav_file(view);
+        return 1;
+    }
+
+    memset(spec, 0, sizeof(*spec));
+    spec->freq = freq;
+    spec->format = format;
+    spec->channels = (Uint8)channels;
+    spec->samples = DEFAULT_SAMPLES;
+
+    //playback and the offline analysis both walk the file front to back
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)view->data & ~(page - 1);
+    madvise((void*)start, (uintptr_t)view->data + view->data_size - start, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+void unmap_wav_file(WavView* view){
+
+    if(view->map != NULL)
+        munmap((void*)view->map, view->map_size);
+    memset(view, 0, sizeof(*view));
+}
+
+void advise_wav_window(const Track* t, const Uint8* pos){
+
+    if(t->wavfile.map == NULL || pos < t->wavfile.data || pos >= t->wavfile.data + t->wavfile.data_size)
+        return;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)pos & ~(page - 1);
+    uintptr_t end = (uintptr_t)t->wavfile.data + t->wavfile.data_size;
+    size_t length = end - start < SEEK_READAHEAD ? end - start : SEEK_READAHEAD;
+    madvise((void*)start, length, MADV_WILLNEED);
+}
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash){
+
+    const Uint8* p = (const Uint8*)data;
+    for(size_t i=0; i<size; i++){
+        hash ^= p[i];
+        hash *= 1099511628211ULL;                   //FNV-1a 64 bit prime
+    }
+    return hash;
+}
+
+bool load_analysis_cache(Track* t){
+
+    t->cache_path[0] = '\0';
+    if(!cache_enabled)
+        return false;
+    if(cache_dir[0] == '\0'){
+        const char* home = getenv("HOME");
+        if(home == NULL)
+            return false;
+        snprintf(cache_dir, sizeof(cache_dir), "%s/%s", home, CACHE_DIR_NAME);
+    }
+
+    //the file name is the key: a changed file or different parameters simply miss, and old entries age out in trim_analysis_cache().
+    //The file is keyed as it is on disk and only sampled, so opening a track costs the same whatever its length
+    //and a compressed one doesn't have to wait for the decoder
+    const uint64_t basis = 14695981039346656037ULL;
+    uint64_t content = file_key(t->filename, basis);
+    int32_t params[] = { (int32_t)CACHE_VERSION, (int32_t)sizeof(CacheHeader), (int32_t)__IsBigEndianMachine(),
+                         (int32_t)t->wavfile.format, t->spec.freq, t->spec.channels, stft_size, stft_hop,
+                         (int32_t)stft_window, t->fft_results.blocks, t->fft_results.bands, (int32_t)spectrum_view };
+    double steps[] = { LEVEL_STEPS_PER_DB, PEAK_STEPS_PER_DB };
+    uint64_t settings = hash_bytes(params, sizeof(params), basis);
+    settings = hash_bytes(steps, sizeof(steps), settings);
+    settings = hash_bytes(t->band_edges.data(), t->band_edges.size()*sizeof(double), settings);
+    snprintf(t->cache_path, sizeof(t->cache_path), "%s/%016llx-%016llx%s", cache_dir,
+             (unsigned long long)content, (unsigned long long)settings, CACHE_SUFFIX);
+    t->cache_content = content;
+    t->cache_params = settings;
+
+    int fd = open(t->cache_path, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)){
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    futimens(fd, NULL);                             //a hit makes the entry the most recently used
+    close(fd);
+    if(map == MAP_FAILED)
+        return false;
+
+    const CacheHeader* h = (const CacheHeader*)map;
+    size_t entries = (size_t)t->fft_results.blocks * t->fft_results.channels;
+    bool valid = memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+              && h->version == CACHE_VERSION && h->header_size == sizeof(CacheHeader)
+              && h->content_hash == content && h->params_hash == settings
+              && h->blocks == t->fft_results.blocks && h->channels == t->fft_results.channels && h->bands == t->fft_results.bands
+              && h->file_size == (uint64_t)st.st_size
+              && h->level_offset + entries*t->fft_results.bands <= h->file_size
+              && h->peakmag_offset + entries*sizeof(uint16_t) <= h->file_size
+              && h->peakfreq_offset + entries*sizeof(uint32_t) <= h->file_size
+              && h->feature_offset + entries*FEATURES*sizeof(float) <= h->file_size
+              && h->onset_offset + entries <= h->file_size
+              && h->band_db_offset + entries*t->fft_results.bands*sizeof(float) <= h->file_size;
+    if(!valid){                                     //truncated or written by something else; analyze again and replace it
+        munmap(map, st.st_size);
+        unlink(t->cache_path);
+        return false;
+    }
+
+    t->cache_map = map;
+    t->cache_map_size = st.st_size;
+    t->fft_results.level = (uint8_t*)map + h->level_offset;
+    t->fft_results.peakmag = (uint16_t*)((Uint8*)map + h->peakmag_offset);
+    t->fft_results.peakfreq = (uint32_t*)((Uint8*)map + h->peakfreq_offset);
+    t->fft_results.feature = (float*)((Uint8*)map + h->feature_offset);
+    t->fft_results.onset = (uint8_t*)map + h->onset_offset;
+    t->fft_results.band_db = (float*)((Uint8*)map + h->band_db_offset);
+    return true;
+}
+
+static size_t cache_align(size_t offset){
+
+    return (offset + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+}
+
+static bool write_all(int fd, const void* data, size_t size){
+
+    const char* p = (const char*)data;
+    while(size > 0){
+        ssize_t n = write(fd, p, size);
+        if(n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void store_analysis_cache(Track* t){
+
+    if(t->cache_path[0] == '\0' || t->cache_map != NULL || t->fft_results.level == nullptr)
+        return;
+    if(make_dirs(cache_dir) != 0){
+        std::cerr << "Warning: could not create the cache directory " << cache_dir << std::endl;
+        return;
+    }
+
+    size_t entries = (size_t)t->fft_results.blocks * t->fft_results.channels;
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    h.version = CACHE_VERSION;
+    h.header_size = sizeof(CacheHeader);
+    h.content_hash = t->cache_content;
+    h.params_hash = t->cache_params;
+    h.blocks = t->fft_results.blocks;
+    h.channels = t->fft_results.channels;
+    h.bands = t->fft_results.bands;
+    h.level_offset = cache_align(sizeof(h));
+    h.peakmag_offset = cache_align(h.level_offset + entries*t->fft_results.bands);
+    h.peakfreq_offset = cache_align(h.peakmag_offset + entries*sizeof(uint16_t));
+    h.feature_offset = cache_align(h.peakfreq_offset + entries*sizeof(uint32_t));
+    h.onset_offset = cache_align(h.feature_offset + entries*FEATURES*sizeof(float));
+    h.band_db_offset = cache_align(h.onset_offset + entries);
+    h.file_size = h.band_db_offset + entries*t->fft_results.bands*sizeof(float);
+
+    //written under a temporary name and renamed, so a reader never maps a half written file
+    char temp[sizeof(t->cache_path) + 32];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", t->cache_path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return;
+    static const char zeros[CACHE_ALIGN] = { 0 };
+    bool ok = write_all(fd, &h, sizeof(h))
+           && write_all(fd, zeros, h.level_offset - sizeof(h))
+           && write_all(fd, t->fft_results.level, entries*t->fft_results.bands)
+           && write_all(fd, zeros, h.peakmag_offset - (h.level_offset + entries*t->fft_results.bands))
+           && write_all(fd, t->fft_results.peakmag, entries*sizeof(uint16_t))
+           && write_all(fd, zeros, h.peakfreq_offset - (h.peakmag_offset + entries*sizeof(uint16_t)))
+           && write_all(fd, t->fft_results.peakfreq, entries*sizeof(uint32_t))
+           && write_all(fd, zeros, h.feature_offset - (h.peakfreq_offset + entries*sizeof(uint32_t)))
+           && write_all(fd, t->fft_results.feature, entries*FEATURES*sizeof(float))
+           && write_all(fd, zeros, h.onset_offset - (h.feature_offset + entries*FEATURES*sizeof(float)))
+           && write_all(fd, t->fft_results.onset, entries)
+           && write_all(fd, zeros, h.band_db_offset - (h.onset_offset + entries))
+           && write_all(fd, t->fft_results.band_db, entries*t->fft_results.bands*sizeof(float));
+    close(fd);
+    if(!ok || rename(temp, t->cache_path) != 0){
+        unlink(temp);
+        return;
+    }
+    trim_analysis_cache(t->cache_path);
+}
+
+struct CacheFile
+{
+    string      path;
+    off_t       size;
+    time_t      used;
+    bool operator<(const CacheFile& other) const { return used < other.used; }
+};
+
+void trim_analysis_cache(const char* keep){
+
+    DIR* dir = opendir(cache_dir);
+    if(dir == NULL)
+        return;
+
+    std::vector<CacheFile> files;
+    long long total = 0;
+    size_t suffix = strlen(CACHE_SUFFIX);
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL){
+        size_t len = strlen(entry->d_name);
+        if(len <= suffix || strcmp(entry->d_name + len - suffix, CACHE_SUFFIX) != 0)
+            continue;
+        CacheFile file;
+        file.path = string(cache_dir) + "/" + entry->d_name;
+        struct stat st;
+        if(stat(file.path.c_str(), &st) != 0)
+            continue;
+        file.size = st.st_size;
+        file.used = st.st_mtime;                    //touched on every hit
+        total += st.st_size;
+        files.push_back(file);
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    long long limit = (long long)cache_limit_mb << 20;
+    for(size_t i=0; i<files.size() && total > limit; i++){
+        if(files[i].path == keep)                   //never the file we just wrote
+            continue;
+        if(unlink(files[i].path.c_str()) == 0)
+            total -= files[i].size;
+    }
+}
+
+int make_dirs(const char* path){
+
+    char partial[1024];
+    snprintf(partial, sizeof(partial), "%s", path);
+    for(char* p = partial + 1; ; p++){
+        if(*p == '/' || *p == '\0'){
+            char c = *p;
+            *p = '\0';
+            if(mkdir(partial, 0755) != 0 && errno != EEXIST)
+                return -1;
+            *p = c;
+            if(c == '\0')
+                break;
+        }
+    }
+    return 0;
+}
+
+int open_decoder(Decoder* d, const char* path, WavView* view, SDL_AudioSpec* spec){
+
+    memset(view, 0, sizeof(*view));
+    d->sf = NULL;
+    d->mh = NULL;
+    long rate = 0;
+    long long frames = 0;
+
+    const char* dot = strrchr(path, '.');
+    if(dot != NULL && (strcasecmp(dot, ".mp3") == 0 || strcasecmp(dot, ".mp2") == 0)){
+        int encoding, channels, error;
+        if(mpg123_init() != MPG123_OK || (d->mh = mpg123_new(NULL, &error)) == NULL)
+            return 1;
+        if(mpg123_open(d->mh, path) != MPG123_OK || mpg123_getformat(d->mh, &rate, &channels, &encoding) != MPG123_OK){
+            std::cerr << "Error: " << mpg123_strerror(d->mh) << std::endl;
+            close_decoder(d);
+            return 1;
+        }
+        mpg123_format_none(d->mh);             //lock the output to 16 bit at the stream's own rate and layout
+        mpg123_format(d->mh, rate, channels, MPG123_ENC_SIGNED_16);
+        mpg123_scan(d->mh);                    //walks the frame headers only, so the length is exact and nothing is decoded twice
+        frames = mpg123_length(d->mh);
+        d->channels = channels;
+    }
+    else{
+        SF_INFO info;
+        memset(&info, 0, sizeof(info));
+        d->sf = sf_open(path, SFM_READ, &info);
+        if(d->sf == NULL){
+            std::cerr << "Error: " << sf_strerror(NULL) << std::endl;
+            return 1;
+        }
+        rate = info.samplerate;
+        frames = info.frames;
+        d->channels = info.channels;
+    }
+    if(frames <= 0 || rate <= 0 || d->channels <= 0 || d->channels > MAX_CHANNELS){
+        close_decoder(d);
+        return 1;
+    }
+
+    //the whole track is reserved up front but the kernel only backs the pages the decoder has written. 16 bit is what
+    //mp3 and most compressed files carry and half the memory of float: an hour of 44.1 kHz stereo is about 635 MB
+    size_t frame_bytes = sizeof(int16_t)*d->channels;
+    if((unsigned long long)frames*frame_bytes > UINT32_MAX){    //audio.length is 32 bit
+        std::cerr << "Error: " << path << " is too long, it decodes to more than 4 GB ("
+                  << (long long)(UINT32_MAX / frame_bytes / rate / 60) << " minutes at this rate and channel count)" << std::endl;
+        close_decoder(d);
+        return 1;
+    }
+    d->capacity = (size_t)frames*frame_bytes;
+    if(d->capacity > d->reserved){                 //the track before was shorter; otherwise its zeroed mapping is reused
+        if(d->pcm != NULL)
+            munmap(d->pcm, d->reserved);
+        d->pcm = NULL;
+        d->reserved = 0;
+        void* map = mmap(NULL, d->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map == MAP_FAILED){
+            close_decoder(d);
+            return 1;
+        }
+        d->pcm = (Uint8*)map;
+        d->reserved = d->capacity;
+    }
+    d->available = 0;
+    d->done = false;
+    d->stop = false;
+    d->active = true;
+
+    view->data = d->pcm;
+    view->data_size = d->capacity;
+    view->format = __IsBigEndianMachine() ? FORMAT_S16BE : FORMAT_S16LE;
+    memset(spec, 0, sizeof(*spec));
+    spec->freq = (int)rate;
+    spec->format = AUDIO_S16SYS;
+    spec->channels = (Uint8)d->channels;
+    spec->samples = DEFAULT_SAMPLES;
+
+    if(pthread_create(&d->tid, NULL, decoder_thread, d) != 0){
+        close_decoder(d);
+        memset(view, 0, sizeof(*view));
+        return 1;
+    }
+    d->started = true;
+    return 0;
+}
+
+void* decoder_thread(void *arg){
+
+    Decoder* d = (Decoder*)arg;
+    size_t frame_bytes = sizeof(int16_t)*d->channels;
+    size_t filled = 0;
+
+    while(!d->stop.load(std::memory_order_relaxed) && filled < d->capacity){
+        size_t want = d->capacity - filled;
+        if(want > DECODE_CHUNK_FRAMES*frame_bytes)
+            want = DECODE_CHUNK_FRAMES*frame_bytes;
+
+        size_t got = 0;
+        if(d->mh != NULL){
+            int err = mpg123_read(d->mh, d->pcm + filled, want, &got);
+            if(err != MPG123_OK && err != MPG123_NEW_FORMAT && got == 0)
+                break;                              //MPG123_DONE or a broken stream
+        }
+        else{
+            sf_count_t n = sf_readf_short(d->sf, (short*)(d->pcm + filled), want/frame_bytes);
+            if(n <= 0)
+                break;
+            got = (size_t)n*frame_bytes;
+        }
+        filled += got;
+        d->available.store(filled, std::memory_order_release);
+    }
+    //a short stream leaves zeros (silence) at the end of the buffer, which playback and analysis read as usual
+    d->done.store(true, std::memory_order_release);
+
+    pthread_exit(NULL);
+}
+
+bool bytes_decoded(const Decoder* d, size_t n){
+
+    if(!d->active || d->done.load(std::memory_order_acquire))
+        return true;
+    return d->available.load(std::memory_order_acquire) >= n;
+}
+
+void wait_for_decoder(const Decoder* d){
+
+    while(d->active && !d->done.load(std::memory_order_acquire) && !time_to_exit)
+        SDL_Delay(1);
+}
+
+void close_decoder(Decoder* d){
+
+    if(d->started){
+        d->stop = true;
+        pthread_join(d->tid, NULL);
+        d->started = false;
+    }
+    if(d->mh != NULL){
+        mpg123_close(d->mh);
+        mpg123_delete(d->mh);
+        d->mh = NULL;
+    }
+    if(d->sf != NULL){
+        sf_close(d->sf);
+        d->sf = NULL;
+    }
+    //the mapping is kept for the next track; dropping the pages gives the memory back and leaves zeros (silence)
+    if(d->pcm != NULL && d->capacity > 0 && d->capacity <= d->reserved)
+        madvise(d->pcm, d->capacity, MADV_DONTNEED);
+    d->capacity = 0;
+    d->active = false;
+}
+
+uint64_t file_key(const char* path, uint64_t hash){
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return hash;
+    struct stat st;
+    if(fstat(fd, &st) == 0){
+        int64_t id[] = { (int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec,
+                         (int64_t)st.st_ino, (int64_t)st.st_dev };
+        hash = hash_bytes(id, sizeof(id), hash);
+        //a few reads wherever the file is, so a file rewritten with the same size and an old mtime still misses
+        Uint8 chunk[CACHE_KEY_CHUNK_BYTES];
+        off_t span = st.st_size > (off_t)CACHE_KEY_CHUNK_BYTES ? st.st_size - (off_t)CACHE_KEY_CHUNK_BYTES : 0;
+        for(int i=0; i<CACHE_KEY_CHUNKS; i++){
+            ssize_t n = pread(fd, chunk, sizeof(chunk), span * i / (CACHE_KEY_CHUNKS - 1));
+            if(n <= 0)
+                break;
+            hash = hash_bytes(chunk, n, hash);
+        }
+    }
+    close(fd);
+    return hash;
+}
+
+uint64_t monotonic_ns(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);            //vDSO, no system call
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+ThreadStats* stats_slot(int slot){
+
+    if(stats_slots[slot] == NULL){
+        stats_slots[slot] = new ThreadStats();      //value-initialized: every counter starts at 0
+        if(stats_slots_used.load(std::memory_order_relaxed) <= slot)
+            stats_slots_used.store(slot + 1, std::memory_order_release);
+    }
+    return stats_slots[slot];
+}
+
+void record_time(ThreadStats* stats, StatStage stage, uint64_t ns){
+
+    if(stats == NULL)
+        return;
+    Histogram& h = stats->stage[stage];
+
+    //bucket: 4 * the power of two below ns + the next two bits, so buckets are at most 25% wide
+    int index = 0;
+    if(ns >= 4){
+        int octave = 63 - __builtin_clzll(ns);
+        index = octave*HIST_SUBBUCKETS + (int)((ns >> (octave - 2)) & (HIST_SUBBUCKETS - 1));
+    }
+    else
+        index = (int)ns;
+    if(index >= HIST_BUCKETS)
+        index = HIST_BUCKETS - 1;
+
+    //only this thread writes the histogram, so a load and a store are enough
+    h.bucket[index].store(h.bucket[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.total_ns.store(h.total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    if(ns > h.max_ns.load(std::memory_order_relaxed))
+        h.max_ns.store(ns, std::memory_order_relaxed);
+    h.count.store(h.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void summarize_stage(StatStage stage, StageSummary& sum){
+
+    memset(&sum, 0, sizeof(sum));
+    int used = stats_slots_used.load(std::memory_order_acquire);
+    for(int s=0; s<used; s++){
+        if(stats_slots[s] == NULL)
+            continue;
+        const Histogram& h = stats_slots[s]->stage[stage];
+        sum.count += h.count.load(std::memory_order_relaxed);
+        sum.total_ns += h.total_ns.load(std::memory_order_relaxed);
+        uint64_t max = h.max_ns.load(std::memory_order_relaxed);
+        if(max > sum.max_ns)
+            sum.max_ns = max;
+        for(int b=0; b<HIST_BUCKETS; b++)
+            sum.bucket[b] += h.bucket[b].load(std::memory_order_relaxed);
+    }
+}
+
+uint64_t percentile_ns(const StageSummary& sum, double fraction){
+
+    uint64_t seen = 0;
+    uint64_t total = 0;
+    for(int b=0; b<HIST_BUCKETS; b++)
+        total += sum.bucket[b];                     //the count may be a little ahead of the buckets while threads write
+    uint64_t wanted = (uint64_t)ceil(total*fraction);
+    for(int b=0; b<HIST_BUCKETS; b++){
+        seen += sum.bucket[b];
+        if(seen >= wanted && seen > 0){
+            if(b < HIST_SUBBUCKETS)
+                return b + 1;
+            int octave = b / HIST_SUBBUCKETS;
+            uint64_t edge = (uint64_t)(HIST_SUBBUCKETS + b % HIST_SUBBUCKETS + 1) << (octave - 2);
+            return edge < sum.max_ns ? edge : sum.max_ns;
+        }
+    }
+    return 0;
+}
+
+void update_lead(const Track* t, int block, bool moving){
+
+    int lead = 0;
+    while(lead < LEAD_SCAN_LIMIT && block_is_ready(t, block + lead))
+        lead++;
+    health.lead.store(lead, std::memory_order_relaxed);
+    if(!moving)
+        return;
+    if(lead == 0)
+        health.stalled_frames.fetch_add(1, std::memory_order_relaxed);
+    int low = health.min_lead.load(std::memory_order_relaxed);
+    if(low < 0 || lead < low)
+        health.min_lead.store(lead, std::memory_order_relaxed);
+}
+
+static const char* STAT_NAMES[STAT_STAGES] = { "callback", "copy", "render", "fft", "block", "prime", "latency" };
+
+void print_stats_overlay(){
+
+    StageSummary sum;
+    for(int s=0; s<STAT_STAGES; s++){
+        summarize_stage((StatStage)s, sum);
+        screen_printf("%-8s n %-8llu p50 %7.1fus  p99 %7.1fus  max %7.1fus\n", STAT_NAMES[s], (unsigned long long)sum.count,
+                      percentile_ns(sum, 0.5)/1E3, percentile_ns(sum, 0.99)/1E3, sum.max_ns/1E3);
+    }
+    screen_printf("deadline %.1fms miss %llu late %llu underrun %llu lead %d%s (min %d) stall %llu\n",
+                  health.deadline_ns/1E6,
+                  (unsigned long long)health.deadline_misses.load(std::memory_order_relaxed),
+                  (unsigned long long)health.late_callbacks.load(std::memory_order_relaxed),
+                  (unsigned long long)health.underruns.load(std::memory_order_relaxed),
+                  health.lead.load(std::memory_order_relaxed), health.lead.load(std::memory_order_relaxed) >= LEAD_SCAN_LIMIT ? "+" : "",
+                  health.min_lead.load(std::memory_order_relaxed),
+                  (unsigned long long)health.stalled_frames.load(std::memory_order_relaxed));
+    if(live_source != nullptr)
+        screen_printf("dropped %llu blocks  overrun %llu bytes\n",
+                      (unsigned long long)health.dropped_blocks.load(std::memory_order_relaxed),
+                      (unsigned long long)health.overrun_bytes.load(std::memory_order_relaxed));
+}
+
+void write_stats_report(const char* path){
+
+    FILE* out = fopen(path, "w");
+    if(out == NULL){
+        std::cerr << "Warning: could not write the stats report to " << path << std::endl;
+        return;
+    }
+
+    fprintf(out, "{\n  \"output_frames\": %d,\n  \"queue_frames\": %lld,\n", have.samples, push_mode ? queue_target.load() : 0LL);
+    fprintf(out, "  \"deadline_ns\": %llu,\n  \"callbacks\": %llu,\n  \"deadline_misses\": %llu,\n"
+                 "  \"late_callbacks\": %llu,\n  \"underruns\": %llu,\n  \"stalled_frames\": %llu,\n  \"min_lead_blocks\": %d,\n"
+                 "  \"dropped_blocks\": %llu,\n  \"overrun_bytes\": %llu,\n",
+            (unsigned long long)health.deadline_ns,
+            (unsigned long long)health.callbacks.load(),
+            (unsigned long long)health.deadline_misses.load(),
+            (unsigned long long)health.late_callbacks.load(),
+            (unsigned long long)health.underruns.load(),
+            (unsigned long long)health.stalled_frames.load(),
+            health.min_lead.load(),
+            (unsigned long long)health.dropped_blocks.load(),
+            (unsigned long long)health.overrun_bytes.load());
+    fprintf(out, "  \"stages\": {\n");
+    StageSummary sum;
+    for(int s=0; s<STAT_STAGES; s++){
+        summarize_stage((StatStage)s, sum);
+        fprintf(out, "    \"%s\": { \"count\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu,\n"
+                     "      \"histogram\": [", STAT_NAMES[s], (unsigned long long)sum.count,
+                (unsigned long long)(sum.count ? sum.total_ns/sum.count : 0),
+                (unsigned long long)percentile_ns(sum, 0.5), (unsigned long long)percentile_ns(sum, 0.9),
+                (unsigned long long)percentile_ns(sum, 0.99), (unsigned long long)sum.max_ns);
+        //[upper edge in ns, count] for every bucket that has something in it
+        bool first = true;
+        for(int b=0; b<HIST_BUCKETS; b++){
+            if(sum.bucket[b] == 0)
+                continue;
+            uint64_t edge = b < HIST_SUBBUCKETS ? b + 1 : (uint64_t)(HIST_SUBBUCKETS + b % HIST_SUBBUCKETS + 1) << (b/HIST_SUBBUCKETS - 2);
+            fprintf(out, "%s[%llu, %llu]", first ? "" : ", ", (unsigned long long)edge, (unsigned long long)sum.bucket[b]);
+            first = false;
+        }
+        fprintf(out, "] }%s\n", s + 1 < STAT_STAGES ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+    fclose(out);
+}
+
+void release_stats(){
+
+    for(int s=0; s<STATS_SLOTS; s++){
+        delete stats_slots[s];
+        stats_slots[s] = NULL;
+    }
+    stats_slots_used = 0;
+}
+
+void PressEnterToContinue()
+{
+  std::cout << "Press ENTER to continue... " << flush;
+  std::cin.ignore( std::numeric_limits <std::streamsize> ::max(), '\n' );
+  std::system("clear");
+}
+
+void* render_thread(void *arg){
+
+    long long drawn = -1;
+    Uint32 frame_ms = 1000 / (render_fps > 0 ? render_fps : DEFAULT_RENDER_FPS);
+
+    while(!time_to_exit) 
+        {
+            Uint32 start = SDL_GetTicks();
+            if(live_source != nullptr)
+                draw_live_frame(drawn);
+            else
+                draw_playback_frame(drawn);
+
+            Uint32 spent = SDL_GetTicks() - start;
+            SDL_Delay(spent < frame_ms ? frame_ms - spent : 1);
+        }
+
+    pthread_exit(NULL);
+}
+
+void draw_playback_frame(long long& drawn){
+
+    const Track* t;
+    long long heard = heard_frame(&t);              //every frame shows its own position, not just one per callback
+    bool moving = heard != drawn || t != drawing.load(std::memory_order_relaxed);
+    //playlist_thread() doesn't reuse a track while it is on the screen
+    drawing.store(t, std::memory_order_release);
+    if(!moving && !show_stats)                      //nothing to redraw once the clock has stopped
+        return;
+
+    uint64_t frame_start = monotonic_ns();
+    double at = block_position(t, heard);
+    Uint32 length = t->wavfile.data_size - (Uint32)(heard*t->frame_bytes);
+    update_lead(t, (int)at, moving && length != 0);
+    screen_begin_frame();
+    printstats(t, (int)at, length);
+    if(show_stats)
+        print_stats_overlay();
+    if(length != 0)
+        printwaveform(t, at);
+    screen_end_frame();
+    record_time(stats_slots[STATS_SLOT_RENDER], STAT_RENDER, monotonic_ns() - frame_start);
+    drawn = heard;
+}
+
+void draw_live_frame(long long& drawn){
+
+    static uint64_t latency_ns = 0;                 //of the last new block drawn, shown on the next frame
+    long long newest = live.blocks.load(std::memory_order_acquire) - 1;
+    if(newest == drawn && !show_stats)
+        return;
+
+    uint64_t frame_start = monotonic_ns();
+    int slot = newest >= 0 ? (int)(newest % LIVE_RESULT_SLOTS) : 0;
+    screen_begin_frame();
+    const Track* t = &tracks[0];
+    printlivestats(t, newest, latency_ns);
+    if(show_stats)
+        print_stats_overlay();
+    if(newest >= 0)
+        printwaveform(t, slot);
+    screen_end_frame();
+    uint64_t now = monotonic_ns();
+    record_time(stats_slots[STATS_SLOT_RENDER], STAT_RENDER, now - frame_start);
+    if(newest != drawn && newest >= 0){             //the block is on the screen now
+        latency_ns = now - live.arrival_ns[slot].load(std::memory_order_relaxed);
+        record_time(stats_slots[STATS_SLOT_RENDER], STAT_LATENCY, latency_ns);
+    }
+    drawn = newest;
+}
+
+void screen_begin_frame(){
+
+    struct winsize ws;
+    int rows = DEFAULT_SCREEN_ROWS;
+    int cols = DEFAULT_SCREEN_COLS;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0){
+        rows = ws.ws_row;
+        cols = ws.ws_col;
+    }
+
+    if(rows != screen.rows || cols != screen.cols){
+        screen_release();
+        screen.rows = rows;
+        screen.cols = cols;
+        screen.cur = new char[rows*cols];
+        screen.prev = new char[rows*cols];
+        //worst case every cell needs its own cursor move: "\x1b[rrrr;ccccH" + the character
+        screen.out_cap = (size_t)rows*cols*16 + 64;
+        screen.out = new char[screen.out_cap];
+        screen.full_redraw = true;
+    }
+
+    if(screen_stale.exchange(false, std::memory_order_acquire))
+        screen.full_redraw = true;
+    memset(screen.cur, ' ', rows*cols);
+    screen.row = 0;
+    screen.col = 0;
+}
+
+void screen_putc(char ch){
+
+    if(ch == '\n'){
+        screen.row++;
+        screen.col = 0;
+        return;
+    }
+    if(ch == '\t'){
+        do{ screen_putc(' '); }while(screen.col % 8 != 0);
+        return;
+    }
+    if(screen.row < screen.rows && screen.col < screen.cols)
+        screen.cur[screen.row*screen.cols + screen.col] = ch;
+    screen.col++;
+}
+
+void screen_printf(const char* format, ...){
+
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    for(const char* ch = line; *ch != '\0'; ++ch)
+        screen_putc(*ch);
+}
+
+void screen_end_frame(){
+
+    char* out = screen.out;
+    out += sprintf(out, "\x1b[?25l");            //hide the cursor while it jumps around
+    if(screen.full_redraw)
+        out += sprintf(out, "\x1b[2J");
+
+    for(int r=0; r<screen.rows; r++){
+        const char* cur = screen.cur + r*screen.cols;
+        const char* prev = screen.prev + r*screen.cols;
+        int c = 0;
+        while(c < screen.cols){
+            if(!screen.full_redraw && cur[c] == prev[c]){ c++; continue; }
+
+            //extend the run over changed cells and over short unchanged gaps, which are cheaper to resend than to skip
+            int end = c + 1;
+            int last_changed = c;
+            while(end < screen.cols && end - last_changed <= SCREEN_MERGE_GAP){
+                if(screen.full_redraw || cur[end] != prev[end])
+                    last_changed = end;
+                end++;
+            }
+            out += sprintf(out, "\x1b[%d;%dH", r+1, c+1);
+            memcpy(out, cur + c, last_changed + 1 - c);
+            out += last_changed + 1 - c;
+            c = last_changed + 1;
+        }
+    }
+    out += sprintf(out, "\x1b[%d;1H\x1b[?25h", screen.rows);  //park the cursor on the last line where typed commands echo
+
+    size_t len = out - screen.out;
+    const char* p = screen.out;
+    while(len > 0){                                 //one write() per frame unless the terminal takes a partial write
+        ssize_t n = write(STDOUT_FILENO, p, len);
+        if(n <= 0)
+            break;
+        p += n;
+        len -= n;
+    }
+
+    std::swap(screen.cur, screen.prev);
+    screen.full_redraw = false;
+}
+
+void screen_invalidate(){
+
+    screen_stale.store(true, std::memory_order_release);   //the render thread owns screen; it picks this up on its next frame
+}
+
+void screen_release(){
+
+    delete [] screen.cur;
+    delete [] screen.prev;
+    delete [] screen.out;
+    screen.cur = screen.prev = screen.out = nullptr;
+    screen.rows = screen.cols = 0;
+}
+
+void printstats(const Track* t, int cc, Uint32 length){
+ 
+    screen_printf("%s%s", "FILE_PATH : ",t->filename);
+    if(playlist.size() > 1)
+        screen_printf("  (%d/%d)", t->index + 1, (int)playlist.size());
+    screen_putc('\n');
+    screen_putc('\n');
+    screen_printf( "Press: \np to pause \ns to start \nr to restart\nq to quit\nb <sec> to rewind song in sec\nf <sec> to fast forward in sec\ng <sec> to go to sec" );
+    screen_putc('\n');
+    const char* message = status_message.load(std::memory_order_relaxed);
+    if(message != nullptr)
+        screen_printf("%s", message);
+    screen_putc('\n');
+   
+    screen_printf("%s%d", "Sample Rate : ", t->spec.freq );
+    screen_putc('\n');
+   
+    screen_printf("%s%d", "Frames (samples) per Period : ", device_frames.load(std::memory_order_relaxed));
+    if(push_mode)
+        screen_printf("%s%lld", "  queued : ", queue_target.load(std::memory_order_relaxed));
+    screen_putc('\n');
+    
+    double val = length/t->spec.channels;
+    
+    val = val / (t->frame_bytes / t->spec.channels); 
+    val = val / t->spec.freq ;
+
+  /* val is in seconds ===>   X [bytes]    frame        channel      sec 
+                             --------- * ----------  * ------- * -------------
+                                 1       2 channels    2 bytes   44.1k frames  */
+
+    screen_printf("%s%.02lf", "TIME Remaining (sec) : ", val);
+    screen_putc('\n');
+
+    if(!block_is_ready(t, cc)){
+        screen_printf("%s", "peak Magn. (dB)\t: analyzing...");
+    }
+    else{
+        double sum = 0;
+        for(int c=0; c<t->spec.channels; c++)
+            sum += peak_magnitude(t, cc, c);
+        float AvgdBPeakMag = 10*log10(sum/t->spec.channels);
+        screen_printf("%s%.2lf", "peak Magn. (dB)\t: ", AvgdBPeakMag > 0 ? AvgdBPeakMag : 0);
+    }
+    screen_putc('\n');
+    
+    screen_printf( "=============================================================\n");
+
+}
+
+void file_info(const Track* t)
+{
+  
+    system("clear");
+    if(t->decoder.mh != NULL){                      //sndfile-info can't read mp3; the decoder thread owns the handle by now
+        long long frames = t->wavfile.data_size / t->frame_bytes;
+        double seconds = (double)frames / t->spec.freq;
+        printf("File : %s\nDecoder : libmpg123\nSample Rate : %d\nFrames : %lld\nChannels : %d\n"
+               "Format : signed 16 bit (decoded)\nDuration : %02d:%02d:%06.3f\n",
+               t->filename, t->spec.freq, frames, (int)t->spec.channels,
+               (int)(seconds/3600), (int)fmod(seconds/60, 60), fmod(seconds, 60));
+        fflush(stdout);
+    }
+    else{
+        char CMD[] = "sndfile-info ";
+        char buffer[128];
+
+
+        snprintf(buffer, 128, "%s %s", CMD,t->filename);
+        system(buffer);
+    }
+
+    PressEnterToContinue();
+}
+
+void store_band_levels(Track* t, int cc, int channel, const double* dB){
+
+    size_t first = ((size_t)cc*t->fft_results.channels + channel)*t->fft_results.bands;
+    uint8_t* level = t->fft_results.level + first;
+    float* band_db = t->fft_results.band_db + first;
+
+    for(int g=0; g<t->fft_results.bands; g++){
+        band_db[g] = (float)dB[g];
+        double q = ceil(dB[g]*LEVEL_STEPS_PER_DB);        //rounded up so the bar keeps the same number of characters;
+        level[g] = (uint8_t)(q <= 0 ? 0 : q >= UINT8_MAX ? UINT8_MAX : q);  //levels below 0 dB draw no bar, so they are clamped to 0
+    }
+}
+
+double band_level_db(const Track* t, int cc, int channel, int band){
+
+    return t->fft_results.level[((size_t)cc*t->fft_results.channels + channel)*t->fft_results.bands + band] / LEVEL_STEPS_PER_DB;
+}
+
+double peak_magnitude(const Track* t, int cc, int channel){
+
+    double dB = t->fft_results.peakmag[(size_t)cc*t->fft_results.channels + channel] / PEAK_STEPS_PER_DB;
+    return pow(10.0, dB/10);
+}
+
+void release_results(Track* t){
+
+    if(t->cache_map != NULL){
+        munmap(t->cache_map, t->cache_map_size);
+        t->cache_map = NULL;
+    }
+    //storage and analysis.ready stay allocated for the next track that uses this slot
+    t->fft_results.level = nullptr;
+    t->fft_results.peakmag = nullptr;
+    t->fft_results.peakfreq = nullptr;
+    t->fft_results.feature = nullptr;
+    t->fft_results.onset = nullptr;
+    t->fft_results.band_db = nullptr;
+    t->blocks = 0;
+}
 
-	return path; 
+const char* wav_graph(const Track* t, double at, int channel, int band){
 
+    static char spectrum[MAX_CHAR_LEN];     //Array to print out waveform on the terminal, rebuilt for every bar
+
+    double level = band_level_at(t, at, channel, band);
+    int len = 0;
+    for(double A=0; A<level && len < MAX_CHAR_LEN-1; A+=CHAR_THRESHOLD)
+        spectrum[len++] = vis[0];
+    spectrum[len] = '\0';
+
+    return spectrum;
+}
+
+double band_level_at(const Track* t, double at, int channel, int band){
+
+    //the bars move smoothly at any frame rate without analyzing more blocks
+    int cc = (int)at;
+    double frac = at - cc;
+    double level = channel < 0 ? downmix_level_db(t, cc, band) : band_level_db(t, cc, channel, band);
+    if(frac > 0 && block_is_ready(t, cc + 1)){
+        double next = channel < 0 ? downmix_level_db(t, cc + 1, band) : band_level_db(t, cc + 1, channel, band);
+        level += frac*(next - level);
+    }
+    return level;
+}
+
+double downmix_level_db(const Track* t, int cc, int band){
+
+    double power = 0;
+    for(int c=0; c<t->fft_results.channels; c++)
+        power += pow(10.0, band_level_db(t, cc, c, band)/10);
+    return 10*log10(power/t->fft_results.channels);
+}
+
+const char* channel_name(int channel, int channels){
+
+    static const char* const mono[] = { "M" };
+    static const char* const stereo[] = { "L", "R" };
+    static const char* const quad[] = { "FL", "FR", "RL", "RR" };
+    static const char* const surround51[] = { "FL", "FR", "C", "LFE", "RL", "RR" };
+    static const char* const surround71[] = { "FL", "FR", "C", "LFE", "RL", "RR", "SL", "SR" };
+    static char other[8];
+
+    switch(channels){
+        case 1: return mono[channel];
+        case 2: return stereo[channel];
+        case 4: return quad[channel];
+        case 6: return surround51[channel];
+        case 8: return surround71[channel];
+    }
+    snprintf(other, sizeof(other), "C%d", channel);
+    return other;
+}
+
+void printwaveform(const Track* t, double at){
+		int cc = (int)at;
+		if(!block_is_ready(t, cc))
+			return;
+		if(spectrum_view){
+			print_spectrum(t, at);
+			return;
+		}
+		if(downmix_view){
+			for(int out=0; out<t->fft_results.bands; out++){
+				screen_printf("M%d%s\n", out, wav_graph(t, at, -1, out));
+				screen_printf("M%d%s\n", out, wav_graph(t, at, -1, out));
+			}
+			return;
+		}
+		if(t->spec.channels > 2){                   //one line per bar so a surround layout fits on the screen
+			for(int c=0; c< t->spec.channels; c++){
+				for(int out=0; out<t->fft_results.bands; out++)
+					screen_printf("%s%d%s\n", channel_name(c, t->spec.channels), out, wav_graph(t, at, c, out));
+				screen_putc('\n');
+			}
+			return;
+		}
+		for(int c=0; c< t->spec.channels; c++){
+			for(int out=0; out<t->fft_results.bands; out++){
+				if(c==0){
+					screen_printf("%s%d%s\n", channel_name(c, t->spec.channels), out, wav_graph(t, at, c, out));
+					screen_printf("%s%d%s\n", channel_name(c, t->spec.channels), out, wav_graph(t, at, c, out));
+				}
+				else{
+					int band = t->fft_results.bands-1-out;
+					screen_printf("R%d%s\n", band, wav_graph(t, at, c, band));
+					screen_printf("R%d%s\n", band, wav_graph(t, at, c, band));
+
+				}
+			}
+	        screen_printf("\n\n\n");
+		}
+		
+		
+
+ }
+
+
+void print_spectrum(const Track* t, double at){
+
+    char line[MAX_CHAR_LEN];
+    double level[MAX_CHAR_LEN];
+    int bars = t->fft_results.bands;
+    int width = std::min(screen.cols - SPECTRUM_LABEL_COLS, MAX_CHAR_LEN - 1);
+    int height = screen.rows - screen.row - 1;
+    int views = downmix_view || t->spec.channels == 1 ? 1 : t->spec.channels;
+    if(width < 1 || height < 2)
+        return;
+    if(height / views < 2)
+        views = 1;                                  //not enough rows for every channel: downmix
+    int rows = height / views;
+    double top = 10*log10(stft_size / 2.0);        //a full scale sine: |X| = size/2
+
+    for(int v=0; v<views; v++){
+        int channel = views == 1 && t->spec.channels > 1 ? -1 : v;
+        //column x shows the loudest of the bars that fall into it; with fewer bars than columns a bar spans several
+        for(int x=0; x<width; x++){
+            int g = x * bars / width;
+            int end = std::max(g + 1, (x + 1) * bars / width);
+            level[x] = band_level_at(t, at, channel, g);
+            for(g++; g<end; g++)
+                level[x] = std::max(level[x], band_level_at(t, at, channel, g));
+            level[x] = level[x] * rows / top;        //in rows
+        }
+        for(int r=rows-1; r>=0; r--){
+            for(int x=0; x<width; x++)
+                line[x] = level[x] > r ? vis[0] : ' ';
+            line[width] = '\0';
+            screen_printf("%-*s%s\n", SPECTRUM_LABEL_COLS, r == rows - 1 ? (channel < 0 ? "M" : channel_name(channel, t->spec.channels)) : "", line);
+        }
+    }
 }
 
 int handle_command_line_args(int argc, char** argv){
 
     int opt;
 
-    while((opt = getopt(argc, argv, "f:")) != -1){
+    while((opt = getopt(argc, argv, "f:F:I:p:w:Psr:l:b:qAj:mB:Q:n:H:W:c:CL:ao:O:SR:")) != -1){
         switch(opt){
 
-            case 'f':
-                        filename = optarg;
+            case 'f':                                       //may be given more than once: the files are played in order
+                        playlist.push_back(optarg);
+                        break;
+            case 'F':                                       //a list of files, one per line
+                        if(read_playlist(optarg)) return 1;
+                        break;
+            case 'I':                                       //live input instead of a file
+                        live_source = optarg;
+                        break;
+            case 'p':                                       //format of the live input
+                        if(parse_live_format(optarg)) goto usage;
+                        break;
+            case 'w':                                       //where fftw wisdom is loaded from and saved to
+                        snprintf(wisdom_path, sizeof(wisdom_path), "%s", optarg);
+                        break;
+            case 'P':                                       //spend longer planning; the result is kept in the wisdom file
+                        analyzer_set_planner(FFTW_PATIENT);
+                        break;
+            case 's':                                       //start playing right away and analyze ahead of the playhead
+                        streaming_mode = true;
+                        break;
+            case 'j':                                       //threads for the offline analysis
+                        analysis_workers = atoi(optarg);
+                        if(analysis_workers <= 0) goto usage;
+                        break;
+            case 'B':                                       //number of log spaced bands instead of the default 5
+                        log_bands = atoi(optarg);
+                        if(log_bands <= 0 || log_bands > MAX_BANDS) goto usage;
+                        break;
+            case 'Q':                                       //high resolution log spectrum drawn across the terminal
+                        log_bands = atoi(optarg);
+                        spectrum_view = true;
+                        if(log_bands < MIN_SPECTRUM_BARS || log_bands > MAX_BANDS) goto usage;
+                        break;
+            case 'n':                                       //frames per fft
+                        stft_size = atoi(optarg);
+                        if(stft_size < MIN_STFT_SIZE || stft_size > MAX_STFT_SIZE || stft_size % 2) goto usage;
+                        break;
+            case 'H':                                       //frames between two blocks; less than -n overlaps them
+                        stft_hop = atoi(optarg);
+                        if(stft_hop <= 0) goto usage;
+                        break;
+            case 'W':                                       //analysis window
+                        if(strcmp(optarg, "rect") == 0) stft_window = WINDOW_RECT;
+                        else if(strcmp(optarg, "hann") == 0) stft_window = WINDOW_HANN;
+                        else if(strcmp(optarg, "blackman") == 0) stft_window = WINDOW_BLACKMAN;
+                        else goto usage;
+                        break;
+            case 'c':                                       //directory of the analysis cache
+                        snprintf(cache_dir, sizeof(cache_dir), "%s", optarg);
+                        break;
+            case 'C':                                       //always analyze, never read or write the cache
+                        cache_enabled = false;
+                        break;
+            case 'L':                                       //size limit of the cache directory
+                        cache_limit_mb = atol(optarg);
+                        if(cache_limit_mb <= 0) goto usage;
+                        break;
+            case 'a':                                       //headless: analyze the files and write the results
+                        batch_mode = true;
+                        break;
+            case 'o':                                       //where -a writes to
+                        batch_output = optarg;
+                        break;
+            case 'O':                                       //what -a writes
+                        if(strcmp(optarg, "bin") == 0) batch_binary = true;
+                        else if(strcmp(optarg, "csv") == 0) batch_binary = false;
+                        else goto usage;
+                        break;
+            case 'S':                                       //timing overlay
+                        show_stats = true;
+                        break;
+            case 'R':                                       //timing report on exit
+                        stats_report = optarg;
+                        break;
+            case 'l':                                       //extra output latency the display is delayed by
+                        output_latency_ms = atoi(optarg);
+                        if(output_latency_ms < 0) goto usage;
+                        break;
+            case 'b':                                       //device buffer size
+                        output_frames = atoi(optarg);
+                        if(output_frames < MIN_OUTPUT_FRAMES || output_frames > MAX_OUTPUT_FRAMES) goto usage;
+                        break;
+            case 'q':                                       //push audio into a queue instead of answering callbacks
+                        push_mode = true;
+                        break;
+            case 'A':                                       //find the smallest buffer that doesn't starve
+                        adaptive_output = push_mode = true;
+                        break;
+            case 'm':                                       //one downmixed set of bars instead of one per channel
+                        downmix_view = true;
+                        break;
+            case 'r':                                       //frame-rate cap of the display
+                        render_fps = atoi(optarg);
+                        if(render_fps <= 0) goto usage;
                         break;
             case '?':
 usage:
-                        fprintf(stderr, "usage: %s [-f PATH_TO_FILE]\n", argv[0] );
+                        fprintf(stderr, "usage: %s -f PATH_TO_FILE|-F LIST [-w WISDOM_FILE] [-P] [-s] [-r FPS] [-l LATENCY_MS] [-b FRAMES] [-q] [-A] [-j THREADS] [-m]\n"
+                                        "       %*s [-B BANDS|-Q BARS] [-n FFT_SIZE] [-H HOP] [-W rect|hann|blackman] [-c CACHE_DIR] [-C] [-L CACHE_MB] [-S] [-R REPORT] [FILE...]\n"
+                                        "       %s -I -|capture[:DEVICE] [-p FORMAT[:RATE[:CHANNELS]]] [-b FRAMES] [-r FPS] [-m] [-B BANDS|-Q BARS] [-n FFT_SIZE] [-H HOP] [-W WINDOW] [-S] [-R REPORT]\n"
+                                        "       %s -a [-o OUTPUT] [-O csv|bin] [-j THREADS] [-B BANDS|-Q BARS] [-n FFT_SIZE] [-H HOP] [-W WINDOW] [-c CACHE_DIR] [-C] [-R REPORT] [-f PATH_TO_FILE] [-F LIST] [FILE...]\n",
+                                        argv[0], (int)strlen(argv[0]), "", argv[0], argv[0] );
                         return 1;
         }
     }
 
-    if(argc != 3) goto usage;                               // error check to make sure there are 3 command line parameters
+    if(stft_hop == 0)
+        stft_hop = stft_size;                       //no overlap, the blocks the player always used
+    if(stft_hop > stft_size) goto usage;
 
-    int len = strlen(filename);
-    const char *last_four = &filename[len-4];
-    
-    if(strcmp(last_four, ".mp3") == 0)
-        filename = getfilepath();
-        if(filename == nullptr)
+    if(live_source != nullptr){                     //a live input replaces the file
+        bool capture = strcmp(live_source, "capture") == 0 || strncmp(live_source, "capture:", 8) == 0;
+        if((!capture && strcmp(live_source, "-") != 0) || !playlist.empty() || batch_mode || optind != argc) goto usage;
+        if(capture && live_format->sdl_format == 0){
+            fprintf(stderr, "%s: SDL can't capture %s samples\n", argv[0], live_format->name);
             return 1;
+        }
+        return 0;
+    }
+
+    for(int i=optind; i<argc; i++)                  //the player and -a both take any number of files
+        playlist.push_back(argv[i]);
+    if(playlist.empty()) goto usage;                // error check to make sure a file was given
     
     return 0;
 }
 
+int read_playlist(const char* path){
+
+    FILE* list = fopen(path, "r");
+    if(list == NULL){
+        std::cerr << "Error: could not open the playlist " << path << std::endl;
+        return 1;
+    }
+    //relative entries are relative to the list, like in an .m3u
+    const char* slash = strrchr(path, '/');
+    string dir = slash != NULL ? string(path, slash - path + 1) : string();
+
+    char line[1024];
+    while(fgets(line, sizeof(line), list) != NULL){
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if(len == 0 || line[0] == '#')              //blank lines and m3u directives
+            continue;
+        playlist.push_back(line[0] == '/' ? string(line) : dir + line);
+    }
+    fclose(list);
+    return 0;
+}
+
 int INITIALIZE_SDL_AND_WAV_VARIABLES(){
     
     SDL_Init(SDL_INIT_AUDIO);                                
-    Uint8* wavStart;                                        //pointer to audio data 
-    Uint32 wavLength;                                       //length of audio data
     
-    if(SDL_LoadWAV(filename, &wavSpec, &wavStart, &wavLength) == NULL)
+    Track* t = &tracks[0];
+    t->filename = playlist[0].c_str();
+    t->index = 0;
+    if(LOAD_AUDIO_FILE(t))
+        return 1;
+
+    
+/*
+    Debugging values of wavSpec 
+    
+
+    std::cout << "wavSpec.freq = " << (int)t->spec.freq << std::endl
+          << "wavSpec.format = 0x" << std::hex << t->spec.format << std::dec << std::endl
+          << "wavSpec.channels = " << (int)t->spec.channels << std::endl
+          << "wavSpec.samples = "   << (int)t->spec.samples << std::endl;
+
+*/
+    return 0;
+}
+
+int LOAD_AUDIO_FILE(Track* t){
+
+    if(map_wav_file(t->filename, &t->wavfile, &t->spec) && open_decoder(&t->decoder, t->filename, &t->wavfile, &t->spec))
     {
         // TODO: Proper error handling
-        std::cerr << "Error: " << filename
+        std::cerr << "Error: " << t->filename
                     << " could not be loaded as an audio file" << std::endl;
         return 1;
     }
 
-    if(wavSpec.channels < 2){
-
-         std::cerr << "Error! Number of channels: " << wavSpec.channels 
-                    << " isnt supported in program yet" << std::endl;
-         return 1;
-    }
-   
-    else if(wavSpec.channels > 2){
+    if(t->spec.channels > MAX_CHANNELS){
 
-         std::cerr << "Error! Number of channels: " << wavSpec.channels 
+         std::cerr << "Error! Number of channels: " << (int)t->spec.channels 
                     << " isnt supported in program yet" << std::endl;
+         close_decoder(&t->decoder);
+         unmap_wav_file(&t->wavfile);
          return 1;
     }   
     
-    audio.beginning = wavStart;                             
-    audio.data_size = wavLength;
-    audio.pos = wavStart;
-    audio.length = wavLength;
-    audio.Samples = wavSpec.samples;
-    audio.SamplesFrequency = wavSpec.freq;
+    t->frame_bytes = (t->wavfile.format == FORMAT_S24LE || t->wavfile.format == FORMAT_S24BE ? 3 : SDL_AUDIO_BITSIZE(t->spec.format)/8)
+                        * t->spec.channels;
+    t->block_size = stft_hop * t->frame_bytes;      //t->spec.size counts device bytes, which differ for 24 bit files
+    t->window_bytes = stft_size * t->frame_bytes;
+    set_analyzer_config(t);
+    if(analyzer_size(&t->config) == 0){
+        std::cerr << "Error: " << t->filename << " can't be analyzed in this format" << std::endl;
+        close_decoder(&t->decoder);
+        unmap_wav_file(&t->wavfile);
+        return 1;
+    }
+    return 0;
+}
 
-    wavSpec.callback = MyAudioCallback;
-    wavSpec.userdata = &audio;
+void cue_track(AudioData* audio, const Track* t){
 
-    
-/*
-    Debugging values of wavSpec 
-    
+    audio->beginning = t->wavfile.data;
+    audio->pos = t->wavfile.data;
+    audio->data_size = t->wavfile.data_size;
+    audio->length = t->wavfile.data_size;
+    audio->frame_bytes = t->frame_bytes;
+}
 
-    std::cout << "wavSpec.freq = " << (int)wavSpec.freq << std::endl
-          << "wavSpec.format = 0x" << std::hex << wavSpec.format << std::dec << std::endl
-          << "wavSpec.channels = " << (int)wavSpec.channels << std::endl
-          << "wavSpec.samples = "   << (int)wavSpec.samples << std::endl;
+void unload_track(Track* t){
 
-*/
-    return 0;
+    if(t->streamed){                                //it stops on its own once the track isn't playing anymore
+        pthread_join(analysis_tid, NULL);
+        analysis_thread_started = false;
+        t->streamed = false;
+    }
+    close_decoder(&t->decoder);
+    unmap_wav_file(&t->wavfile);
+    release_results(t);
+    t->prepared.store(false, std::memory_order_relaxed);
+}
+
+void free_track(Track* t){
+
+    unload_track(t);
+    delete [] t->storage.level;
+    delete [] t->storage.peakmag;
+    delete [] t->storage.peakfreq;
+    delete [] t->storage.feature;
+    delete [] t->storage.onset;
+    delete [] t->storage.band_db;
+    delete [] t->analysis.ready;
+    t->storage.level = nullptr;
+    t->storage.peakmag = nullptr;
+    t->storage.peakfreq = nullptr;
+    t->storage.feature = nullptr;
+    t->storage.onset = nullptr;
+    t->storage.band_db = nullptr;
+    t->analysis.ready = nullptr;
+    t->level_capacity = t->entry_capacity = 0;
+    t->ready_capacity = 0;
+    if(t->decoder.pcm != NULL)
+        munmap(t->decoder.pcm, t->decoder.reserved);
+    t->decoder.pcm = NULL;
+    t->decoder.reserved = 0;
+}
+
+void* playlist_thread(void *arg){
+
+    for(size_t i=1; i<playlist.size() && !time_to_exit; i++){
+        //the slot that isn't playing: the track before the current one, finished by now
+        Track* t = playing.load(std::memory_order_acquire) == &tracks[0] ? &tracks[1] : &tracks[0];
+        while(render_thread_started && drawing.load(std::memory_order_acquire) == t && !time_to_exit)
+            SDL_Delay(10);                          //the screen still shows the end of it
+        if(time_to_exit)
+            break;
+
+        //load, decode and analyze the whole next track while this one plays, so it can start on the sample
+        unload_track(t);
+        t->filename = playlist[i].c_str();
+        t->index = (int)i;
+        if(LOAD_AUDIO_FILE(t))                      //says why on stderr; the playlist goes on with the file after it
+            continue;
+        if(!initializer_vars(t))
+            ANALYZE_ALL_BLOCKS(t);
+        wait_for_decoder(&t->decoder);              //a cache hit skips the analysis and its wait; the gapless switch copies
+                                                    //from the track without asking the decoder
+        if(time_to_exit)
+            break;
+        t->prepared.store(true, std::memory_order_release);
+
+        while(playing.load(std::memory_order_acquire) != t && !time_to_exit){
+            if(reopen_output.exchange(false, std::memory_order_acq_rel)){
+                //the current track has ended and the device can't play this one as it is: not gapless, but it plays
+                close_output();
+                if(open_output(t) == 0){
+                    //skip it: the device goes back to the format of the track that ended, cued at its end,
+                    //and this slot takes the file after it
+                    Track* ended = t == &tracks[0] ? &tracks[1] : &tracks[0];
+                    std::cerr << "Error: could not reopen the output for " << t->filename << ", skipping it" << std::endl;
+                    t->prepared.store(false, std::memory_order_relaxed);
+                    if(open_output(ended) == 0){
+                        std::cerr << "Error: lost the output device, press 'q' to quit" << std::endl;
+                        time_to_exit = true;
+                        break;
+                    }
+                    seek_to_frame(&audio, ended->wavfile.data_size / ended->frame_bytes);  //still paused, nothing else touches audio
+                    start_output();
+                    screen_invalidate();
+                    break;
+                }
+                start_output();
+                screen_invalidate();
+            }
+            SDL_Delay(10);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+SDL_AudioDeviceID open_output(Track* t){
+
+    SDL_AudioSpec want = t->spec, got;
+    want.callback = push_mode ? NULL : MyAudioCallback;
+    want.userdata = &audio;
+    if(adaptive_output)
+        want.samples = ADAPTIVE_START_FRAMES;
+    else if(output_frames > 0)
+        want.samples = output_frames;
+
+    output_device = SDL_OpenAudioDevice(NULL, 0, &want, &got, SDL_AUDIO_ALLOW_ANY_CHANGE);
+    if(output_device == 0)
+    {
+        // TODO: Proper error handling
+        std::cerr << "Error: " << SDL_GetError() << std::endl;
+        return 0;
+    }
+    SDL_AudioSpec format = t->spec;                 //the track's own format, before the device's changes below: what later
+                                                    //tracks are compared with, see fits_device()
+
+    //Update audio information if device has changed any default settings
+    if(!render_thread_started){                     //only the first time; later the screen belongs to the renderer
+        if(want.format != got.format)
+            cout << "wavSpec.format updated!: " << std::hex << got.format << std::dec << endl;
+        if(want.samples != got.samples)
+            cout << "wavSpec.samples updated!: " << got.samples << endl;
+        if(want.freq != got.freq)
+            cout << "wavSpec.freq updated!: " << got.freq << endl;
+    }
+    t->spec.format = got.format;
+    t->spec.samples = got.samples;
+    t->spec.freq = got.freq;
+    t->spec.size = got.size;
+    audio.Samples = got.samples;
+    audio.SamplesFrequency = got.freq;
+    if(queue_target.load(std::memory_order_relaxed) < QUEUE_PERIODS * (long long)got.samples)
+        queue_target = QUEUE_PERIODS * (long long)got.samples;    //-A keeps what it learned across a reopen
+    health.deadline_ns = (uint64_t)audio.Samples * 1000000000ULL / audio.SamplesFrequency;
+    health.last_callback_ns = 0;
+
+    //the device is paused, so nothing else touches audio; the render thread only reads the device through
+    //device_frames and device_rate, which are published with the track
+    cue_track(&audio, t);
+    gc = 0;
+    t->prepared.store(false, std::memory_order_relaxed);
+    requested = format;
+    have = got;
+    device_frames.store(got.samples, std::memory_order_relaxed);
+    device_rate.store(got.freq, std::memory_order_relaxed);
+    playing.store(t, std::memory_order_release);
+    return output_device;
+}
+
+void start_output(){
+
+    if(push_mode){
+        if(pthread_create(&feeder_tid, NULL, feeder_thread, (void*)(uintptr_t)output_device) == 0)
+            feeder_thread_started = true;
+        else
+            std::cerr << "Error: could not start the feeder thread" << std::endl;
+    }
+    SDL_PauseAudioDevice(output_device, 0);
+}
+
+void close_output(){
+
+    if(feeder_thread_started){
+        feeder_stop = true;
+        pthread_join(feeder_tid, NULL);
+        feeder_thread_started = false;
+        feeder_stop = false;
+    }
+    if(output_device != 0)
+        SDL_CloseAudioDevice(output_device);        //no more callbacks after this returns
+    output_device = 0;
+}
+
+int BATCH_ANALYZE_FILES(){
+
+    FILE* out = stdout;
+    if(batch_output != nullptr && (out = fopen(batch_output, batch_binary ? "wb" : "w")) == NULL){
+        std::cerr << "Error: could not open " << batch_output << std::endl;
+        return (int)playlist.size();
+    }
+
+    Track* t = &tracks[0];                          //one slot, reused file after file
+    int failed = 0;
+    bool header_written = false;                    //by the first file that loads, which needn't be the first one
+    for(size_t i=0; i<playlist.size(); i++){
+        t->filename = playlist[i].c_str();
+        t->index = (int)i;
+        if(LOAD_AUDIO_FILE(t)){                     //says why on stderr
+            failed++;
+            continue;
+        }
+        if(!initializer_vars(t))
+            ANALYZE_ALL_BLOCKS(t);
+        if(batch_binary){
+            if(!write_results_binary(t, out)){
+                std::cerr << "Error: could not write the results of " << t->filename << std::endl;
+                unload_track(t);
+                failed = (int)playlist.size();
+                break;
+            }
+        }
+        else{
+            write_results_csv(t, out, !header_written);
+            header_written = true;
+        }
+
+        unload_track(t);
+    }
+
+    if(fflush(out) != 0 || ferror(out)){
+        std::cerr << "Error: could not write the results" << std::endl;
+        failed = (int)playlist.size();
+    }
+    if(out != stdout)
+        fclose(out);
+    free_track(t);
+    mpg123_exit();
+    analyzer_shutdown();
+    if(stats_report != nullptr)
+        write_stats_report(stats_report);
+    release_stats();
+    return failed;
+}
+
+void write_results_csv(const Track* t, FILE* out, bool header){
+
+    if(header){
+        fprintf(out, "file,block,time,channel,peak_hz,peak_db,rms_db,centroid_hz,rolloff_hz,flux,onset");
+        for(int g=0; g<t->fft_results.bands; g++)
+            fprintf(out, ",band%d_db", g);
+        fputc('\n', out);
+    }
+    for(int cc=0; cc<t->fft_results.blocks; cc++){
+        double time = (double)cc*stft_hop/t->spec.freq;
+        for(int c=0; c<t->fft_results.channels; c++){
+            size_t entry = (size_t)cc*t->fft_results.channels + c;
+            const float* feature = t->fft_results.feature + entry*FEATURES;
+            write_csv_field(out, t->filename);
+            fprintf(out, ",%d,%.3f,%d,%u,%.2f,%.2f,%.1f,%.1f,%.3f,%d", cc, time, c,
+                    t->fft_results.peakfreq[entry], t->fft_results.peakmag[entry] / PEAK_STEPS_PER_DB,
+                    feature[FEATURE_RMS], feature[FEATURE_CENTROID], feature[FEATURE_ROLLOFF], feature[FEATURE_FLUX],
+                    t->fft_results.onset[entry]);
+            for(int g=0; g<t->fft_results.bands; g++)
+                fprintf(out, ",%.1f", t->fft_results.band_db[entry*t->fft_results.bands + g]);
+            fputc('\n', out);
+        }
+    }
+}
+
+void write_csv_field(FILE* out, const char* text){
+
+    if(strpbrk(text, ",\"\r\n") == NULL){
+        fputs(text, out);
+        return;
+    }
+    fputc('"', out);
+    for(const char* p = text; *p != '\0'; p++){
+        if(*p == '"')
+            fputc('"', out);                        //a quote inside the field is doubled
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+bool write_results_binary(const Track* t, FILE* out){
+
+    const char* name = t->filename;
+    BatchHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BATCH_MAGIC, sizeof(BATCH_MAGIC));
+    h.version = BATCH_VERSION;
+    h.header_size = sizeof(BatchHeader);
+    h.name_length = strlen(name);
+    h.rate = t->spec.freq;
+    h.block_frames = stft_hop;
+    h.fft_size = stft_size;
+    h.window = stft_window;
+    h.blocks = t->fft_results.blocks;
+    h.channels = t->fft_results.channels;
+    h.bands = t->fft_results.bands;
+    h.peak_steps_per_db = PEAK_STEPS_PER_DB;
+
+    size_t entries = (size_t)t->fft_results.blocks * t->fft_results.channels;
+    return fwrite(&h, sizeof(h), 1, out) == 1
+        && fwrite(name, 1, h.name_length, out) == h.name_length
+        && fwrite(t->fft_results.band_db, sizeof(float), entries*t->fft_results.bands, out) == entries*t->fft_results.bands
+        && fwrite(t->fft_results.peakmag, sizeof(uint16_t), entries, out) == entries
+        && fwrite(t->fft_results.peakfreq, sizeof(uint32_t), entries, out) == entries
+        && fwrite(t->fft_results.feature, sizeof(float), entries*FEATURES, out) == entries*FEATURES
+        && fwrite(t->fft_results.onset, 1, entries, out) == entries;
 }
 
-void CLEANUPMESS(SDL_AudioDeviceID device){
+int LIVE_ANALYZE(){
+
+    bool from_stdin = strcmp(live_source, "-") == 0;
+    SDL_AudioDeviceID device = 0;
+    Track* t = &tracks[0];
+
+    t->filename = live_source;
+    t->spec.freq = live_rate;
+    t->spec.channels = live_channels;
+    t->spec.format = live_format->sdl_format;
+    t->wavfile.format = live_format->format;
+    t->frame_bytes = live_format->bytes * live_channels;
+    t->block_size = stft_hop * t->frame_bytes;
+    t->window_bytes = stft_size * t->frame_bytes;
+    set_analyzer_config(t);
+
+    //the results are a ring of LIVE_RESULT_SLOTS blocks, set up like a track of that many blocks
+    t->wavfile.data_size = LIVE_RESULT_SLOTS * t->block_size;
+    cache_enabled = false;
+    initializer_vars(t);
+    load_wisdom();
+
+    live_ring.size = LIVE_RING_BYTES;
+    live_ring.data = new Uint8[live_ring.size];
+    stats_slot(STATS_SLOT_AUDIO);
+    stats_slot(STATS_SLOT_RENDER);
+    stats_slot(STATS_SLOT_STREAMING);
+
+    //the analysis is started first so the ring is drained from the first byte on
+    if(pthread_create(&analysis_tid, NULL, live_analysis_thread, t) != 0){
+        std::cerr << "Error: could not start the analysis thread" << std::endl;
+        return 1;
+    }
+    analysis_thread_started = true;
+
+    if(from_stdin){
+        if(pthread_create(&live_input_tid, NULL, stdin_reader_thread, NULL) == 0)
+            live_input_started = true;
+        else
+            live.input_done = true;
+    }
+    else{
+        SDL_Init(SDL_INIT_AUDIO);
+        SDL_AudioSpec want;
+        SDL_zero(want);
+        want.freq = live_rate;
+        want.format = live_format->sdl_format;
+        want.channels = live_channels;
+        want.samples = output_frames > 0 ? output_frames : LIVE_CAPTURE_FRAMES;
+        want.callback = live_capture_callback;
+        const char* name = live_source[7] == ':' ? live_source + 8 : NULL;
+        device = SDL_OpenAudioDevice(name, 1, &want, &have, 0);     //no changes allowed: SDL converts to what we asked for
+        if(device == 0){
+            std::cerr << "Error: " << SDL_GetError() << std::endl;
+            live.input_done = true;
+        }
+        else{
+            health.deadline_ns = (uint64_t)have.samples * 1000000000ULL / have.freq;
+            SDL_PauseAudioDevice(device, 0);
+        }
+    }
+
+    if(pthread_create(&render_tid, NULL, render_thread, NULL) == 0)
+        render_thread_started = true;
+    else
+        std::cerr << "Error: could not start the render thread" << std::endl;
+
+    if(from_stdin){                                 //the keyboard is the pipe, so this runs until the input ends
+        while(!live.finished)
+            SDL_Delay(10);
+        SDL_Delay(2 * 1000 / (render_fps > 0 ? render_fps : DEFAULT_RENDER_FPS));   //let the last block be drawn
+    }
+    else if(device != 0){
+        int c;
+        while((c = getchar()) != 'q' && c != EOF)
+            if(c == '\n')
+                screen_invalidate();                    //the echo of the line, as in AUDIO_DEVICE_CONTROL()
+    }
+
     time_to_exit = true;
-    //  pthread_join(id1, NULL);
-    //  pthread_mutex_destroy(&work_mutex);
-    SDL_CloseAudioDevice(device);
-    SDL_FreeWAV(audio.beginning);
-    SDL_Quit();
+    if(device != 0)
+        SDL_CloseAudioDevice(device);               //no more callbacks after this returns
+    if(render_thread_started)
+        pthread_join(render_tid, NULL);
+    screen_release();
+    pthread_join(analysis_tid, NULL);
+    if(live_input_started)
+        pthread_join(live_input_tid, NULL);
+    if(!from_stdin)
+        SDL_Quit();
+
+    StageSummary latency;
+    summarize_stage(STAT_LATENCY, latency);
+    fprintf(stderr, "%lld blocks analyzed, %llu dropped, %llu bytes overrun, input to screen p50 %.1f ms p99 %.1f ms\n",
+            live.blocks.load(), (unsigned long long)health.dropped_blocks.load(), (unsigned long long)health.overrun_bytes.load(),
+            percentile_ns(latency, 0.5)/1E6, percentile_ns(latency, 0.99)/1E6);
+
+    save_wisdom();
+    analyzer_shutdown();
+    t->wavfile.data_size = 0;                       //nothing was mapped
+    free_track(t);
+    delete [] live_ring.data;
+    live_ring.data = NULL;
+    if(stats_report != nullptr)
+        write_stats_report(stats_report);
+    release_stats();
+    return device != 0 || from_stdin ? 0 : 1;
+}
 
-    
-    char buffer[1024];
-    snprintf(buffer, 1024, "rm -f temp.wav"); 
-    system(buffer);
+int parse_live_format(const char* text){
+
+    const char* colon = strchr(text, ':');
+    size_t length = colon != NULL ? (size_t)(colon - text) : strlen(text);
+
+    live_format = NULL;
+    for(size_t i=0; i<sizeof(LIVE_FORMATS)/sizeof(LIVE_FORMATS[0]); i++)
+        if(strlen(LIVE_FORMATS[i].name) == length && strncmp(text, LIVE_FORMATS[i].name, length) == 0)
+            live_format = &LIVE_FORMATS[i];
+    if(live_format == NULL)
+        return 1;
+    if(colon == NULL)
+        return 0;
+
+    char* end;
+    live_rate = (int)strtol(colon + 1, &end, 10);
+    if(*end == ':')
+        live_channels = (int)strtol(end + 1, &end, 10);
+    return *end != '\0' || live_rate <= 0 || live_channels <= 0 || live_channels > MAX_CHANNELS;
+}
+
+bool ring_write(const Uint8* src, size_t n){
+
+    size_t head = live_ring.head.load(std::memory_order_relaxed);
+    size_t tail = live_ring.tail.load(std::memory_order_acquire);
+    if(n > live_ring.size - (head - tail))
+        return false;
+    size_t at = head & (live_ring.size - 1);
+    size_t first = std::min(n, live_ring.size - at);
+    memcpy(live_ring.data + at, src, first);
+    memcpy(live_ring.data, src + first, n - first);
+
+    size_t w = live_ring.writes.load(std::memory_order_relaxed);
+    int k = (int)(w & (LIVE_WRITE_STAMPS - 1));
+    live_ring.stamp_end[k].store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);    //a reader sees the slot as replaced before it sees the new time
+    live_ring.stamp_ns[k].store(monotonic_ns(), std::memory_order_relaxed);
+    live_ring.stamp_end[k].store(head + n, std::memory_order_release);
+    live_ring.writes.store(w + 1, std::memory_order_release);
+    live_ring.head.store(head + n, std::memory_order_release);
+    return true;
+}
+
+uint64_t ring_arrival(size_t position){
+
+    //back from the newest write to the first one that reached the position; a write only stamps where it ended,
+    //so the byte before position arrived with it. Stamps the producer replaces meanwhile end the search
+    size_t w = live_ring.writes.load(std::memory_order_acquire);
+    uint64_t arrival = 0;
+    for(size_t i = w; i > 0 && w - i < (size_t)LIVE_WRITE_STAMPS; i--){
+        int k = (int)((i - 1) & (LIVE_WRITE_STAMPS - 1));
+        size_t end = live_ring.stamp_end[k].load(std::memory_order_acquire);
+        uint64_t ns = live_ring.stamp_ns[k].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(end == 0 || end != live_ring.stamp_end[k].load(std::memory_order_relaxed) || end < position)
+            break;
+        arrival = ns;
+    }
+    return arrival != 0 ? arrival : monotonic_ns();
+}
+
+void ring_read(size_t position, Uint8* dst, size_t n){
+
+    size_t at = position & (live_ring.size - 1);
+    size_t first = std::min(n, live_ring.size - at);
+    memcpy(dst, live_ring.data + at, first);
+    memcpy(dst + first, live_ring.data, n - first);
+}
+
+void live_capture_callback(void* userdata, Uint8* stream, int streamLength){
+
+    uint64_t start = monotonic_ns();
+    if(!ring_write(stream, streamLength))           //never wait on SDL's thread: a full ring loses this buffer
+        health.overrun_bytes.fetch_add(streamLength, std::memory_order_relaxed);
+    record_time(stats_slots[STATS_SLOT_AUDIO], STAT_CALLBACK, monotonic_ns() - start);
+    health.callbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* stdin_reader_thread(void *arg){
+
+    Uint8 chunk[LIVE_READ_BYTES];
+
+    while(!time_to_exit){
+        ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        //a pipe can wait: the writer is held back instead of losing audio, the analysis keeps the latency bounded
+        while(!ring_write(chunk, n) && !time_to_exit)
+            SDL_Delay(1);
+    }
+    live.input_done.store(true, std::memory_order_release);
+
+    pthread_exit(NULL);
+}
+
+void* live_analysis_thread(void *arg){
+
+    Track* t = (Track*)arg;
+    Uint8* block = new Uint8[t->window_bytes];
+    size_t tail = 0;
+    long long b = 0;
+
+    ThreadStats* stats = stats_slots[STATS_SLOT_STREAMING];
+    Analyzer* analyzer = analyzer_create(&t->config, NULL);
+    while(analyzer != NULL && !time_to_exit){
+        bool done = live.input_done.load(std::memory_order_acquire);   //before head, so the last write isn't missed
+        size_t available = live_ring.head.load(std::memory_order_acquire) - tail;
+        if(available < t->window_bytes){
+            if(done)
+                break;
+            SDL_Delay(1);
+            continue;
+        }
+
+        //stay current: blocks the display would show too late are skipped instead of queueing up behind it
+        size_t behind = (available - t->window_bytes) / t->block_size;
+        if(behind > (size_t)LIVE_BACKLOG_BLOCKS){
+            size_t skip = behind - LIVE_BACKLOG_BLOCKS;
+            tail += skip * t->block_size;
+            health.dropped_blocks.fetch_add(skip, std::memory_order_relaxed);
+        }
 
+        //the time its last byte came in, which can be several writes before the newest one
+        uint64_t arrival = ring_arrival(tail + t->window_bytes);
+        ring_read(tail, block, t->window_bytes);
+        int slot = (int)(b % LIVE_RESULT_SLOTS);
+        analyze_block(t, analyzer, block, t->window_bytes, slot, (long long)(tail / t->block_size), stats);
+        live.arrival_ns[slot].store(arrival, std::memory_order_relaxed);
+        live.blocks.store(++b, std::memory_order_release);
 
+        tail += t->block_size;
+        live_ring.tail.store(tail, std::memory_order_release);  //the producer may overwrite what we read only now
+    }
+
+    analyzer_destroy(analyzer);
+    delete [] block;
+    live.finished = true;
+
+    pthread_exit(NULL);
+}
+
+void printlivestats(const Track* t, long long newest, uint64_t latency_ns){
+
+    screen_printf("%s%s", "INPUT : ", strcmp(live_source, "-") == 0 ? "stdin" : live_source);
+    screen_putc('\n');
+    screen_putc('\n');
+    if(strcmp(live_source, "-") != 0)
+        screen_printf("Press: \nq to quit\n\n");
+
+    screen_printf("%s%d  %s  %d ch", "Sample Rate : ", t->spec.freq, live_format->name, live_channels);
+    screen_putc('\n');
+    screen_printf("%s%d  hop %d", "Frames per Block : ", stft_size, stft_hop);
+    screen_putc('\n');
+    screen_printf("%s%lld  dropped %llu  overrun %llu bytes", "Blocks : ", newest + 1,
+                  (unsigned long long)health.dropped_blocks.load(std::memory_order_relaxed),
+                  (unsigned long long)health.overrun_bytes.load(std::memory_order_relaxed));
+    screen_putc('\n');
+    screen_printf("%s%.1f", "Input to screen (ms) : ", latency_ns/1E6);
+    screen_putc('\n');
+
+    int slot = newest >= 0 ? (int)(newest % LIVE_RESULT_SLOTS) : 0;
+    if(newest < 0){
+        screen_printf("%s", "peak Magn. (dB)\t: waiting for input...");
+    }
+    else{
+        double sum = 0;
+        for(int c=0; c<t->spec.channels; c++)
+            sum += peak_magnitude(t, slot, c);
+        float AvgdBPeakMag = 10*log10(sum/t->spec.channels);
+        screen_printf("%s%.2lf", "peak Magn. (dB)\t: ", AvgdBPeakMag > 0 ? AvgdBPeakMag : 0);
+    }
+    screen_putc('\n');
+
+    screen_printf( "=============================================================\n");
+}
+
+void CLEANUPMESS(){
+    time_to_exit = true;
+    if(render_thread_started)
+        pthread_join(render_tid, NULL);
+    if(playlist_thread_started)
+        pthread_join(playlist_tid, NULL);
+    close_output();
+    screen_release();
+    if(analysis_thread_started){
+        pthread_join(analysis_tid, NULL);
+        analysis_thread_started = false;
+        for(int i=0; i<2; i++)
+            tracks[i].streamed = false;
+    }
+    save_wisdom();
+    for(int i=0; i<2; i++)
+        free_track(&tracks[i]);
+    SDL_Quit();
+    mpg123_exit();
+    analyzer_shutdown();
+    if(stats_report != nullptr)
+        write_stats_report(stats_report);
+    release_stats();
 }
\ No newline at end of file
@@ -0,0 +1,1048 @@
+/*
+    Author: T. Turner
+
+    The analysis pipeline of analyzer.h: parse (deinterleave + window), fft, band extraction.
+*/
+
+
+#include "analyzer.h"
+#include <fftw3.h>
+#include <pthread.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+
+static const int        PLANAR_ALIGN = 4;           //channel rows are padded to multiples of 4 doubles (32 bytes) so each one starts aligned
+static const double     DEFAULT_BAND_EDGES[ANALYZER_DEFAULT_BANDS + 1] = { 19, 140, 400, 2600, 5200, 1E9 };   //Hz, the last band runs up to Nyquist
+static const double     LOG_BANDS_LOW_HZ = 20;      //lowest edge of a log spaced layout
+static const double     BAND_FLOOR = 1.7E-308;      //power of a band that has no bins
+static const int        ROLLOFF_CHUNK = 16;         //bins between two running sums the rolloff search starts from, a multiple of 4
+static const double     ONSET_FLUX = 0.3;           //an onset needs at least this much of the spectrum to be new,
+static const double     ONSET_RISE_DB = 1.5;        //the level to rise by at least this much since the previous block
+static const double     ONSET_FLOOR_DB = -60;       //and the block to be louder than this
+
+
+//converts interleaved samples to planar doubles: channel c of frame f goes to dst[c*stride + f]
+typedef void (*DeinterleaveKernel)(const uint8_t* src, int frames, int channels, double* dst, int stride);
+
+struct BandLayout                       //which FFT bins feed which band; built once per (rate, FFT size, bands, weighted)
+{
+    int         rate;
+    int         F;                      //FFT size in frames
+    int         bands;
+    bool        weighted;
+    double*     edges;                  //[bands+1] in Hz
+    uint16_t*   bin_band;               //[F/2] band index of every bin, 'bands' for bins outside every band
+    int*        first;                  //[bands] first bin of the band; a band is one contiguous run of bins
+    int*        last;                   //[bands] one past its last bin
+    double*     weight;                 //weighted: sparse kernel, band g weighs bins [first[g], last[g]) with weight[weight_at[g]...];
+    int*        weight_at;              //          the runs of neighbouring bands overlap. NULL otherwise
+};
+
+struct PlanCacheEntry
+{
+    int         n;                      //transform size in frames
+    int         howmany;                //number of channels transformed by the plan
+    fftw_plan   p;
+};
+
+struct Analyzer
+{
+    AnalyzerConfig      config;
+    Arena               arena;          //the analyzer's own arena, base is NULL when it lives in the caller's
+    int                 frame_bytes;    //bytes of one sample frame (all channels)
+    DeinterleaveKernel  deinterleave;
+    const BandLayout*   layout;         //shared, read-only
+    fftw_plan           plan;           //shared; executed on this analyzer's own arrays
+    double*             in;             //planar channels x frames: channel c starts at in[c*in_stride(F)]
+    fftw_complex*       out;            //F/2+1 complex bins per channel: channel c starts at out[c*out_stride(F)]
+    double*             power;          //[F/2+1] squared magnitudes of the channel being extracted
+    double*             window;         //[F] coefficients scaled to a mean of 1, NULL for WINDOW_RECT
+    double              power_gain;     //mean of the squared coefficients, 1 for WINDOW_RECT: what the window adds to the power
+    uint8_t*            pending;        //PCM pushed but not analyzed yet, the start of the next block first
+    size_t              pending_bytes;
+    long long           next_block;     //index of the block that starts at pending
+    double*             slots;          //queue+1 frames of slot_doubles; the last one is the scratch frame of analyzer_extract()
+    AnalyzerFeatures*   features;       //[queue+1][channel] features of the frames in slots
+    long long*          slot_block;     //[queue] block index of every queued frame
+    double*             previous;       //magnitudes of the previous block: channel c starts at previous[c*previous_stride(F)]
+    double              previous_rms_db[ANALYZER_MAX_CHANNELS];
+    long long           previous_block; //block previous holds, -1 for the silence before block 0
+    double*             cumulative;     //power below every ROLLOFF_CHUNK bins of the channel being extracted
+    int                 head;           //oldest queued frame
+    int                 count;          //frames queued
+};
+
+//shared by every analyzer in the process; the fftw planner isn't thread safe, executing plans is
+static pthread_mutex_t              shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<PlanCacheEntry>  plan_cache;
+static std::vector<BandLayout*>     band_layouts;
+static unsigned                     planner_flags = FFTW_MEASURE;
+static bool                         wisdom_dirty = false;  //set when the planner had to build a plan that wasn't in the cache
+
+
+static bool big_endian_host(){
+
+    const int one = 1;
+    return *(const char*)&one == 0;
+}
+
+static size_t arena_round(size_t bytes){
+
+    return (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+static int in_stride(int F){
+
+    return (F + PLANAR_ALIGN - 1) / PLANAR_ALIGN * PLANAR_ALIGN;
+}
+
+static int out_stride(int F){
+
+    return (F/2 + 1 + PLANAR_ALIGN/2 - 1) / (PLANAR_ALIGN/2) * (PLANAR_ALIGN/2);   //a complex bin is two doubles
+}
+
+static int previous_stride(int F){
+
+    return (F/2 + PLANAR_ALIGN - 1) / PLANAR_ALIGN * PLANAR_ALIGN;
+}
+
+static int rolloff_chunks(int F){
+
+    return (F/2 + ROLLOFF_CHUNK - 1) / ROLLOFF_CHUNK;
+}
+
+static int sample_bytes(SampleFormat format){
+
+    switch(format){
+        case FORMAT_U8:                                     return 1;
+        case FORMAT_S16LE: case FORMAT_S16BE:
+        case FORMAT_U16LE: case FORMAT_U16BE:               return 2;
+        case FORMAT_S24LE: case FORMAT_S24BE:               return 3;
+        case FORMAT_S32LE: case FORMAT_S32BE:
+        case FORMAT_F32LE: case FORMAT_F32BE:               return 4;
+        default:                                            return 0;
+    }
+}
+
+static int config_bands(const AnalyzerConfig* config){
+
+    return config->bands > 0 ? config->bands : ANALYZER_DEFAULT_BANDS;
+}
+
+static int slot_doubles(const AnalyzerConfig* config){
+
+    return config->channels * config_bands(config) + 2 * config->channels;    //levels, peak dB, peak Hz
+}
+
+static bool valid_config(const AnalyzerConfig* c){
+
+    return c != NULL && c->rate > 0 && c->channels >= 1 && c->channels <= ANALYZER_MAX_CHANNELS
+        && sample_bytes(c->format) > 0 && c->fft_size >= 2 && c->fft_size % 2 == 0
+        && c->hop >= 1 && c->hop <= c->fft_size && c->bands >= 0 && c->bands <= ANALYZER_MAX_BANDS
+        && (!c->weighted || c->bands > 0) && c->queue >= 0
+        && (c->window == WINDOW_RECT || c->window == WINDOW_HANN || c->window == WINDOW_BLACKMAN);
+}
+
+/*
+    Sample decoders for the templated kernels. load() turns one sample into a double in [-1, 1).
+    The endianness of the file is part of the type, so nothing is checked per sample.
+*/
+struct U8Sample    { enum { BYTES = 1 }; static double load(const uint8_t* p){ return (p[0] - 128) / 128.0; } };
+struct S16LESample { enum { BYTES = 2 }; static double load(const uint8_t* p){ return (int16_t)(p[0] | p[1] << 8) / 32768.0; } };
+struct S16BESample { enum { BYTES = 2 }; static double load(const uint8_t* p){ return (int16_t)(p[1] | p[0] << 8) / 32768.0; } };
+struct U16LESample { enum { BYTES = 2 }; static double load(const uint8_t* p){ return ((p[0] | p[1] << 8) - 32768) / 32768.0; } };
+struct U16BESample { enum { BYTES = 2 }; static double load(const uint8_t* p){ return ((p[1] | p[0] << 8) - 32768) / 32768.0; } };
+struct S24LESample { enum { BYTES = 3 }; static double load(const uint8_t* p){ return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) / 2147483648.0; } };
+struct S24BESample { enum { BYTES = 3 }; static double load(const uint8_t* p){ return (int32_t)((uint32_t)p[2] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[0] << 24) / 2147483648.0; } };
+struct S32LESample { enum { BYTES = 4 }; static double load(const uint8_t* p){ return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24) / 2147483648.0; } };
+struct S32BESample { enum { BYTES = 4 }; static double load(const uint8_t* p){ return (int32_t)((uint32_t)p[3] | (uint32_t)p[2] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[0] << 24) / 2147483648.0; } };
+struct F32LESample { enum { BYTES = 4 }; static double load(const uint8_t* p){ uint32_t u = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; float f; memcpy(&f, &u, 4); return f; } };
+struct F32BESample { enum { BYTES = 4 }; static double load(const uint8_t* p){ uint32_t u = (uint32_t)p[3] | (uint32_t)p[2] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[0] << 24; float f; memcpy(&f, &u, 4); return f; } };
+
+//portable kernel: one pass per channel so every store is sequential
+template<class Sample>
+static void deinterleave_scalar(const uint8_t* src, int frames, int channels, double* dst, int stride){
+
+    const int frame_bytes = Sample::BYTES * channels;
+    for(int c=0; c<channels; c++){
+        const uint8_t* p = src + c*Sample::BYTES;
+        double* out = dst + (size_t)c*stride;
+        for(int f=0; f<frames; f++, p += frame_bytes)
+            out[f] = Sample::load(p);
+    }
+}
+
+#if defined(__SSE2__)
+//32 bit float little endian stereo, 2 frames per iteration
+static void deinterleave_f32le_stereo_sse2(const uint8_t* src, int frames, int channels, double* dst, int stride){
+
+    double* left = dst;
+    double* right = dst + stride;
+    int f = 0;
+
+    for(; f + 2 <= frames; f += 2){
+        __m128 x = _mm_loadu_ps((const float*)(src + f*8));                   //L0 R0 L1 R1
+        x = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3,1,2,0));                         //L0 L1 R0 R1
+        _mm_storeu_pd(left + f,  _mm_cvtps_pd(x));
+        _mm_storeu_pd(right + f, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+    }
+    if(f < frames)
+        deinterleave_scalar<F32LESample>(src + f*8, frames - f, channels, dst + f, stride);
+}
+#endif
+
+//the 16 bit kernels follow the selector: with AVX2 the SSE2 one is never picked
+#if defined(__AVX2__)
+//signed 16 bit little endian stereo, 8 frames per iteration
+static void deinterleave_s16le_stereo_avx2(const uint8_t* src, int frames, int channels, double* dst, int stride){
+
+    const __m256d scale = _mm256_set1_pd(1.0/32768.0);
+    const __m256i order = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    double* left = dst;
+    double* right = dst + stride;
+    int f = 0;
+
+    for(; f + 8 <= frames; f += 8){
+        __m256i a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + f*4)));       //L0 R0 .. L3 R3
+        __m256i b = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + f*4 + 16)));  //L4 R4 .. L7 R7
+        a = _mm256_permutevar8x32_epi32(a, order);                                              //L0..L3 R0..R3
+        b = _mm256_permutevar8x32_epi32(b, order);
+        _mm256_storeu_pd(left + f,      _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(a)), scale));
+        _mm256_storeu_pd(left + f + 4,  _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(b)), scale));
+        _mm256_storeu_pd(right + f,     _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)), scale));
+        _mm256_storeu_pd(right + f + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(b, 1)), scale));
+    }
+    if(f < frames)
+        deinterleave_scalar<S16LESample>(src + f*4, frames - f, channels, dst + f, stride);
+}
+#elif defined(__SSE2__)
+//signed 16 bit little endian stereo, 4 frames per iteration
+static void deinterleave_s16le_stereo_sse2(const uint8_t* src, int frames, int channels, double* dst, int stride){
+
+    const __m128d scale = _mm_set1_pd(1.0/32768.0);
+    double* left = dst;
+    double* right = dst + stride;
+    int f = 0;
+
+    for(; f + 4 <= frames; f += 4){
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + f*4));             //L0 R0 L1 R1 L2 R2 L3 R3
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);           //L0 R0 L1 R1 as int32
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);           //L2 R2 L3 R3
+        lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3,1,2,0));                    //L0 L1 R0 R1
+        hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3,1,2,0));                    //L2 L3 R2 R3
+        _mm_storeu_pd(left + f,      _mm_mul_pd(_mm_cvtepi32_pd(lo), scale));
+        _mm_storeu_pd(left + f + 2,  _mm_mul_pd(_mm_cvtepi32_pd(hi), scale));
+        _mm_storeu_pd(right + f,     _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(lo, 8)), scale));
+        _mm_storeu_pd(right + f + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(hi, 8)), scale));
+    }
+    if(f < frames)
+        deinterleave_scalar<S16LESample>(src + f*4, frames - f, channels, dst + f, stride);
+}
+#endif
+
+static DeinterleaveKernel select_deinterleave_kernel(SampleFormat format, int channels){
+
+    //the vector kernels read samples with the host's byte order, so they only apply on little endian machines.
+    //only stereo S16LE and F32LE have them; every other format and layout runs the scalar template
+    bool stereo_le_host = channels == 2 && !big_endian_host();
+    (void)stereo_le_host;
+
+    switch(format){
+        case FORMAT_U8:     return deinterleave_scalar<U8Sample>;
+        case FORMAT_S16LE:
+#if defined(__AVX2__)
+            if(stereo_le_host) return deinterleave_s16le_stereo_avx2;
+#elif defined(__SSE2__)
+            if(stereo_le_host) return deinterleave_s16le_stereo_sse2;
+#endif
+            return deinterleave_scalar<S16LESample>;
+        case FORMAT_S16BE:  return deinterleave_scalar<S16BESample>;
+        case FORMAT_U16LE:  return deinterleave_scalar<U16LESample>;
+        case FORMAT_U16BE:  return deinterleave_scalar<U16BESample>;
+        case FORMAT_S24LE:  return deinterleave_scalar<S24LESample>;
+        case FORMAT_S24BE:  return deinterleave_scalar<S24BESample>;
+        case FORMAT_S32LE:  return deinterleave_scalar<S32LESample>;
+        case FORMAT_S32BE:  return deinterleave_scalar<S32BESample>;
+        case FORMAT_F32LE:
+#if defined(__SSE2__)
+            if(stereo_le_host) return deinterleave_f32le_stereo_sse2;
+#endif
+            return deinterleave_scalar<F32LESample>;
+        case FORMAT_F32BE:  return deinterleave_scalar<F32BESample>;
+        default:            return NULL;
+    }
+}
+
+static double segment_max(const double* p, int first, int last){
+
+    double m = BAND_FLOOR;                          //an empty band reads as silence
+    int i = first;
+#if defined(__AVX__)
+    __m256d vm = _mm256_set1_pd(BAND_FLOOR);
+    for(; i + 8 <= last; i += 8){
+        vm = _mm256_max_pd(vm, _mm256_loadu_pd(p + i));
+        vm = _mm256_max_pd(vm, _mm256_loadu_pd(p + i + 4));
+    }
+    __m128d half = _mm_max_pd(_mm256_castpd256_pd128(vm), _mm256_extractf128_pd(vm, 1));
+    half = _mm_max_pd(half, _mm_unpackhi_pd(half, half));
+    m = _mm_cvtsd_f64(half);
+#elif defined(__SSE2__)
+    __m128d vm = _mm_set1_pd(BAND_FLOOR);
+    for(; i + 4 <= last; i += 4){
+        vm = _mm_max_pd(vm, _mm_loadu_pd(p + i));
+        vm = _mm_max_pd(vm, _mm_loadu_pd(p + i + 2));
+    }
+    vm = _mm_max_pd(vm, _mm_unpackhi_pd(vm, vm));
+    m = _mm_cvtsd_f64(vm);
+#endif
+    for(; i < last; i++)
+        if(p[i] > m)
+            m = p[i];
+    return m;
+}
+
+static double segment_dot(const double* a, const double* b, int n){
+
+    double sum = 0;
+    int i = 0;
+#if defined(__AVX__)
+    __m256d vs = _mm256_setzero_pd();
+    for(; i + 4 <= n; i += 4)
+        vs = _mm256_add_pd(vs, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(vs), _mm256_extractf128_pd(vs, 1));
+    sum = _mm_cvtsd_f64(_mm_add_pd(half, _mm_unpackhi_pd(half, half)));
+#elif defined(__SSE2__)
+    __m128d vs = _mm_setzero_pd();
+    for(; i + 2 <= n; i += 2)
+        vs = _mm_add_pd(vs, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    sum = _mm_cvtsd_f64(_mm_add_pd(vs, _mm_unpackhi_pd(vs, vs)));
+#endif
+    for(; i < n; i++)
+        sum += a[i]*b[i];
+    return sum;
+}
+
+static void build_spectrum_kernel(BandLayout* layout, const double* edges){
+
+    //every bar is a triangle in log frequency that peaks at the bar's centre and reaches zero at its neighbours' centres,
+    //so every bin between two centres is shared by those two bars. A bar narrower than a bin interpolates between
+    //the two bins around its centre instead of going blank.
+    int bands = layout->bands;
+    int bins = layout->F/2;
+    double hz_per_bin = (double)layout->rate / layout->F;
+    std::vector<double> weights;
+    layout->weight_at = new int[bands];
+
+    for(int g=0; g<bands; g++){
+        double centre = sqrt(edges[g] * edges[g+1]);
+        double spread = log2(edges[g+1] / edges[g]);   //octaves between two centres
+        int first = std::max(1, (int)ceil(centre * pow(2.0, -spread) / hz_per_bin));
+        int last = std::min(bins, (int)floor(centre * pow(2.0, spread) / hz_per_bin) + 1);
+        size_t at = weights.size();
+        double total = 0;
+        for(int m=first; m<last; m++){
+            double w = 1 - fabs(log2(m * hz_per_bin / centre)) / spread;
+            weights.push_back(w > 0 ? w : 0);
+            total += weights.back();
+        }
+        if(total <= 0){
+            double x = std::min(centre / hz_per_bin, bins - 1.0);
+            first = std::min((int)x, bins - 2 > 0 ? bins - 2 : 0);
+            last = first + 2;
+            weights.resize(at);
+            weights.push_back(1 - (x - first));
+            weights.push_back(x - first);
+            total = 1;
+        }
+        for(size_t k=at; k<weights.size(); k++)
+            weights[k] /= total;                    //an average, so a bar doesn't grow with the number of bins under it
+        layout->first[g] = first;
+        layout->last[g] = last;
+        layout->weight_at[g] = (int)at;
+    }
+
+    layout->weight = new double[weights.size() + 1];
+    std::copy(weights.begin(), weights.end(), layout->weight);
+}
+
+
+int analyzer_make_band_edges(int rate, int bands, double* edges){
+
+    if(bands <= 0){
+        std::copy(DEFAULT_BAND_EDGES, DEFAULT_BAND_EDGES + ANALYZER_DEFAULT_BANDS + 1, edges);
+        return ANALYZER_DEFAULT_BANDS;
+    }
+    //log spaced from LOG_BANDS_LOW_HZ up to the Nyquist frequency
+    double low = LOG_BANDS_LOW_HZ;
+    double high = rate / 2.0;
+    for(int g=0; g<=bands; g++)
+        edges[g] = low * pow(high/low, (double)g/bands);
+    return bands;
+}
+
+//call with shared_mutex held
+static const BandLayout* get_band_layout(const AnalyzerConfig* config){
+
+    int F = config->fft_size;
+    for(size_t i=0; i<band_layouts.size(); i++){
+        const BandLayout* l = band_layouts[i];
+        if(l->F == F && l->rate == config->rate && l->bands == config_bands(config) && l->weighted == config->weighted)
+            return l;
+    }
+
+    BandLayout* layout = new BandLayout;
+    int bins = F/2;
+    layout->rate = config->rate;
+    layout->F = F;
+    layout->weighted = config->weighted;
+    layout->edges = new double[config_bands(config) + 1];
+    layout->bands = analyzer_make_band_edges(config->rate, config->bands, layout->edges);
+    int bands = layout->bands;
+    layout->bin_band = new uint16_t[bins > 0 ? bins : 1];
+    layout->first = new int[bands];
+    layout->last = new int[bands];
+
+    //a bin belongs to band g when edge[g] < freq <= edge[g+1]; bins outside every band get index 'bands'
+    for(int m=0; m<bins; m++){
+        float freq = m * (float)config->rate / F;
+        int g = 0;
+        while(g < bands && !(freq > layout->edges[g] && freq <= layout->edges[g+1]))
+            g++;
+        layout->bin_band[m] = (uint16_t)g;
+    }
+    //the edges only grow, so every band is one contiguous run of bins in the table
+    for(int g=0; g<bands; g++){
+        int m = 0;
+        while(m < bins && layout->bin_band[m] != g)
+            m++;
+        layout->first[g] = m;
+        while(m < bins && layout->bin_band[m] == g)
+            m++;
+        layout->last[g] = m;
+    }
+    layout->weight = NULL;
+    layout->weight_at = NULL;
+    if(config->weighted)
+        build_spectrum_kernel(layout, layout->edges);
+
+    band_layouts.push_back(layout);
+    return layout;
+}
+
+//call with shared_mutex held. Planning with FFTW_MEASURE overwrites the arrays, so it is done before they hold samples
+static fftw_plan get_cached_plan(int n, int howmany, double* in, fftw_complex* out){
+
+    for(size_t i=0; i<plan_cache.size(); ++i)
+        if(plan_cache[i].n == n && plan_cache[i].howmany == howmany)
+            return plan_cache[i].p;
+
+    PlanCacheEntry entry;
+    entry.n = n;
+    entry.howmany = howmany;
+    //channels are planar: each one is a run of n reals and n/2+1 complex bins, padded so every run starts aligned
+    entry.p = fftw_plan_many_dft_r2c(1, &n, howmany, in, NULL, 1, in_stride(n), out, NULL, 1, out_stride(n), planner_flags);
+    if(entry.p != NULL){
+        plan_cache.push_back(entry);
+        wisdom_dirty = true;
+    }
+    return entry.p;
+}
+
+bool arena_init(Arena* arena, size_t size){
+
+    void* base = NULL;
+    if(posix_memalign(&base, ARENA_ALIGN, size > 0 ? size : 1) != 0)
+        return false;
+    arena->base = (uint8_t*)base;
+    arena->size = size;
+    arena->used = 0;
+    arena->owned = true;
+    return true;
+}
+
+void arena_wrap(Arena* arena, void* memory, size_t size){
+
+    arena->base = (uint8_t*)memory;
+    arena->size = size;
+    arena->used = 0;
+    arena->owned = false;
+}
+
+void* arena_alloc(Arena* arena, size_t bytes){
+
+    size_t at = arena_round(arena->used);
+    if(arena->base == NULL || at > arena->size || arena->size - at < bytes)
+        return NULL;
+    arena->used = at + bytes;
+    return arena->base + at;
+}
+
+void arena_release(Arena* arena){
+
+    if(arena->owned)
+        free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->owned = false;
+}
+
+size_t analyzer_size(const AnalyzerConfig* config){
+
+    if(!valid_config(config))
+        return 0;
+    int F = config->fft_size;
+    size_t bytes = arena_round(sizeof(Analyzer))
+                 + arena_round(sizeof(double) * in_stride(F) * config->channels)
+                 + arena_round(sizeof(fftw_complex) * out_stride(F) * config->channels)
+                 + arena_round(sizeof(double) * (F/2 + 1))
+                 + arena_round(sizeof(double) * (config->queue + 1) * slot_doubles(config))
+                 + arena_round(sizeof(AnalyzerFeatures) * (config->queue + 1) * config->channels)
+                 + arena_round(sizeof(double) * previous_stride(F) * config->channels)
+                 + arena_round(sizeof(double) * rolloff_chunks(F));
+    if(config->window != WINDOW_RECT)
+        bytes += arena_round(sizeof(double) * F);
+    if(config->queue > 0)
+        bytes += arena_round((size_t)F * config->channels * sample_bytes(config->format))
+               + arena_round(sizeof(long long) * config->queue);
+    return bytes;
+}
+
+static void build_window(Analyzer* a){
+
+    //periodic windows, so overlapping blocks tile the signal evenly
+    int F = a->config.fft_size;
+    double sum = 0;
+    for(int i=0; i<F; i++){
+        double x = 2*M_PI*i/F;
+        a->window[i] = a->config.window == WINDOW_HANN ? 0.5 - 0.5*cos(x)
+                                                       : 0.42 - 0.5*cos(x) + 0.08*cos(2*x);
+        sum += a->window[i];
+    }
+    //divided by the coherent gain, so a tone reads the same level whatever the window
+    double squares = 0;
+    for(int i=0; i<F; i++){
+        a->window[i] *= F / sum;
+        squares += a->window[i]*a->window[i];
+    }
+    a->power_gain = squares / F;
+}
+
+Analyzer* analyzer_create(const AnalyzerConfig* config, Arena* arena){
+
+    size_t size = analyzer_size(config);
+    if(size == 0)
+        return NULL;
+
+    Arena own;
+    if(arena == NULL){
+        if(!arena_init(&own, size))
+            return NULL;
+        arena = &own;
+    }
+    size_t rollback = arena->used;
+    int F = config->fft_size;
+
+    Analyzer* a = (Analyzer*)arena_alloc(arena, sizeof(Analyzer));
+    double* in = (double*)arena_alloc(arena, sizeof(double) * in_stride(F) * config->channels);
+    fftw_complex* out = (fftw_complex*)arena_alloc(arena, sizeof(fftw_complex) * out_stride(F) * config->channels);
+    double* power = (double*)arena_alloc(arena, sizeof(double) * (F/2 + 1));
+    double* slots = (double*)arena_alloc(arena, sizeof(double) * (config->queue + 1) * slot_doubles(config));
+    AnalyzerFeatures* features = (AnalyzerFeatures*)arena_alloc(arena, sizeof(AnalyzerFeatures) * (config->queue + 1) * config->channels);
+    double* previous = (double*)arena_alloc(arena, sizeof(double) * previous_stride(F) * config->channels);
+    double* cumulative = (double*)arena_alloc(arena, sizeof(double) * rolloff_chunks(F));
+    double* window = config->window != WINDOW_RECT ? (double*)arena_alloc(arena, sizeof(double) * F) : NULL;
+    uint8_t* pending = NULL;
+    long long* slot_block = NULL;
+    if(config->queue > 0){
+        pending = (uint8_t*)arena_alloc(arena, (size_t)F * config->channels * sample_bytes(config->format));
+        slot_block = (long long*)arena_alloc(arena, sizeof(long long) * config->queue);
+    }
+    if(a == NULL || in == NULL || out == NULL || power == NULL || slots == NULL || features == NULL || previous == NULL || cumulative == NULL
+       || (config->window != WINDOW_RECT && window == NULL) || (config->queue > 0 && (pending == NULL || slot_block == NULL))){
+        arena->used = rollback;                     //the caller's arena is left as it was
+        if(arena == &own)
+            arena_release(&own);
+        return NULL;
+    }
+
+    a->config = *config;
+    a->frame_bytes = config->channels * sample_bytes(config->format);
+    a->deinterleave = select_deinterleave_kernel(config->format, config->channels);
+    a->in = in;
+    a->out = out;
+    a->power = power;
+    a->window = window;
+    a->power_gain = 1;
+    a->pending = pending;
+    a->slots = slots;
+    a->features = features;
+    a->slot_block = slot_block;
+    a->previous = previous;
+    a->cumulative = cumulative;
+    if(window != NULL)
+        build_window(a);
+
+    pthread_mutex_lock(&shared_mutex);
+    a->plan = get_cached_plan(F, config->channels, in, out);
+    a->layout = get_band_layout(config);
+    pthread_mutex_unlock(&shared_mutex);
+
+    if(a->plan == NULL){
+        arena->used = rollback;
+        if(arena == &own)
+            arena_release(&own);
+        return NULL;
+    }
+    //the analyzer keeps its own arena in itself; a caller's arena stays the caller's
+    if(arena == &own)
+        a->arena = own;
+    else
+        arena_wrap(&a->arena, NULL, 0);
+    analyzer_reset(a);
+    return a;
+}
+
+void analyzer_destroy(Analyzer* a){
+
+    if(a == NULL || a->arena.base == NULL)
+        return;
+    Arena own = a->arena;                           //the analyzer itself lives in it
+    arena_release(&own);
+}
+
+const AnalyzerConfig* analyzer_config(const Analyzer* a){
+
+    return &a->config;
+}
+
+size_t analyzer_window_bytes(const Analyzer* a){
+
+    return (size_t)a->config.fft_size * a->frame_bytes;
+}
+
+size_t analyzer_hop_bytes(const Analyzer* a){
+
+    return (size_t)a->config.hop * a->frame_bytes;
+}
+
+const double* analyzer_band_edges(const Analyzer* a){
+
+    return a->layout->edges;
+}
+
+static void frame_from_slot(const Analyzer* a, int slot, long long block, AnalyzerFrame* frame){
+
+    int channels = a->config.channels;
+    const double* level = a->slots + (size_t)slot * slot_doubles(&a->config);
+    frame->block = block;
+    frame->channels = channels;
+    frame->bands = a->layout->bands;
+    frame->level = level;
+    frame->peak_db = level + channels * a->layout->bands;
+    frame->peak_hz = frame->peak_db + channels;
+    frame->features = a->features + (size_t)slot * channels;
+}
+
+struct SpectrumSums                     //what fused_spectrum() adds up in its one pass over a channel
+{
+    double      power;                  //of bins [0, F/2)
+    double      moment;                 //bin * power, for the centroid
+    double      rise;                   //how much the magnitude of every bin rose since the previous block
+    double      magnitude;              //of the whole spectrum, to scale the rise with
+    double      peak;                   //largest power of a bin
+    int         peak_bin;               //the first bin that has it
+};
+
+#if defined(__AVX__)
+static double hsum(__m256d v){
+
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_pd(half, _mm_unpackhi_pd(half, half)));
+}
+#elif defined(__SSE2__)
+static double hsum(__m128d v){
+
+    return _mm_cvtsd_f64(_mm_add_pd(v, _mm_unpackhi_pd(v, v)));
+}
+#endif
+
+//one pass over the bins of one channel: the power spectrum for the bands, the sums every feature is made of and the
+//magnitudes the next block's flux is measured against, which replace the previous ones in place. cumulative[k] is
+//the power of bins [0, (k+1)*ROLLOFF_CHUNK), so the rolloff only has to search one chunk afterwards.
+static void fused_spectrum(const fftw_complex* out, int bins, double* power, double* previous, double* cumulative, SpectrumSums* s){
+
+    double total = 0, moment = 0, rise = 0, magnitude = 0, peak = BAND_FLOOR;
+    int m = 0, peak_bin = -1;
+#if defined(__AVX__)
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d four = _mm256_set1_pd(4);
+    __m256d vtotal = zero, vmoment = zero, vrise = zero, vmagnitude = zero;
+    __m256d vpeak = _mm256_set1_pd(BAND_FLOOR);
+    __m256d vpeak_at = _mm256_set1_pd(-1);                              //bin of every lane's peak, as doubles like vindex
+    __m256d vindex = _mm256_setr_pd(0, 1, 2, 3);
+#elif defined(__SSE2__)
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d two = _mm_set1_pd(2);
+    __m128d vtotal = zero, vmoment = zero, vrise = zero, vmagnitude = zero;
+    __m128d vpeak = _mm_set1_pd(BAND_FLOOR);
+    __m128d vpeak_at = _mm_set1_pd(-1);
+    __m128d vindex = _mm_setr_pd(0, 1);
+#endif
+
+    for(int k=0; m<bins; k++){
+        int end = std::min(m + ROLLOFF_CHUNK, bins);
+#if defined(__AVX__)
+        for(; m + 4 <= end; m += 4){
+            __m256d a = _mm256_loadu_pd(out[m]);                        //re0 im0 re1 im1
+            __m256d b = _mm256_loadu_pd(out[m + 2]);                    //re2 im2 re3 im3
+            __m256d lo = _mm256_permute2f128_pd(a, b, 0x20);            //re0 im0 re2 im2
+            __m256d hi = _mm256_permute2f128_pd(a, b, 0x31);            //re1 im1 re3 im3
+            __m256d re = _mm256_unpacklo_pd(lo, hi);                    //re0 re1 re2 re3
+            __m256d im = _mm256_unpackhi_pd(lo, hi);                    //im0 im1 im2 im3
+            __m256d p = _mm256_add_pd(_mm256_mul_pd(re, re), _mm256_mul_pd(im, im));
+            __m256d mag = _mm256_sqrt_pd(p);
+            __m256d up = _mm256_max_pd(_mm256_sub_pd(mag, _mm256_loadu_pd(previous + m)), zero);
+            _mm256_storeu_pd(power + m, p);
+            _mm256_storeu_pd(previous + m, mag);
+            vtotal = _mm256_add_pd(vtotal, p);
+            vmoment = _mm256_add_pd(vmoment, _mm256_mul_pd(vindex, p));
+            vrise = _mm256_add_pd(vrise, up);
+            vmagnitude = _mm256_add_pd(vmagnitude, mag);
+            vpeak_at = _mm256_blendv_pd(vpeak_at, vindex, _mm256_cmp_pd(p, vpeak, _CMP_GT_OQ));
+            vpeak = _mm256_max_pd(vpeak, p);
+            vindex = _mm256_add_pd(vindex, four);
+        }
+#elif defined(__SSE2__)
+        for(; m + 2 <= end; m += 2){
+            __m128d a = _mm_loadu_pd(out[m]);                           //re0 im0
+            __m128d b = _mm_loadu_pd(out[m + 1]);                       //re1 im1
+            __m128d re = _mm_unpacklo_pd(a, b);
+            __m128d im = _mm_unpackhi_pd(a, b);
+            __m128d p = _mm_add_pd(_mm_mul_pd(re, re), _mm_mul_pd(im, im));
+            __m128d mag = _mm_sqrt_pd(p);
+            __m128d up = _mm_max_pd(_mm_sub_pd(mag, _mm_loadu_pd(previous + m)), zero);
+            _mm_storeu_pd(power + m, p);
+            _mm_storeu_pd(previous + m, mag);
+            vtotal = _mm_add_pd(vtotal, p);
+            vmoment = _mm_add_pd(vmoment, _mm_mul_pd(vindex, p));
+            vrise = _mm_add_pd(vrise, up);
+            vmagnitude = _mm_add_pd(vmagnitude, mag);
+            __m128d above = _mm_cmpgt_pd(p, vpeak);
+            vpeak_at = _mm_or_pd(_mm_and_pd(above, vindex), _mm_andnot_pd(above, vpeak_at));
+            vpeak = _mm_max_pd(vpeak, p);
+            vindex = _mm_add_pd(vindex, two);
+        }
+#endif
+        for(; m<end; m++){                          //only the last chunk can have bins left over
+            double p = out[m][0]*out[m][0] + out[m][1]*out[m][1];
+            double mag = sqrt(p);
+            double up = mag - previous[m];
+            power[m] = p;
+            previous[m] = mag;
+            total += p;
+            moment += m*p;
+            rise += up > 0 ? up : 0;
+            magnitude += mag;
+            if(p > peak){
+                peak = p;
+                peak_bin = m;
+            }
+        }
+#if defined(__AVX__) || defined(__SSE2__)
+        cumulative[k] = hsum(vtotal) + total;
+#else
+        cumulative[k] = total;
+#endif
+    }
+
+#if defined(__AVX__) || defined(__SSE2__)
+    total += hsum(vtotal);
+    moment += hsum(vmoment);
+    rise += hsum(vrise);
+    magnitude += hsum(vmagnitude);
+    double lanes[4], lanes_at[4];
+#if defined(__AVX__)
+    const int width = 4;
+    _mm256_storeu_pd(lanes, vpeak);
+    _mm256_storeu_pd(lanes_at, vpeak_at);
+#else
+    const int width = 2;
+    _mm_storeu_pd(lanes, vpeak);
+    _mm_storeu_pd(lanes_at, vpeak_at);
+#endif
+    double lane_peak = BAND_FLOOR;
+    int lane_bin = -1;
+    for(int l=0; l<width; l++){                     //ties go to the lowest bin, as in a scan from the bottom
+        if(lanes[l] > lane_peak || (lanes[l] == lane_peak && lanes_at[l] >= 0 && lanes_at[l] < lane_bin)){
+            lane_peak = lanes[l];
+            lane_bin = (int)lanes_at[l];
+        }
+    }
+    if(lane_peak >= peak && lane_bin >= 0){         //the scalar tail only has bins above every lane's
+        peak = lane_peak;
+        peak_bin = lane_bin;
+    }
+#endif
+    s->power = total;
+    s->moment = moment;
+    s->rise = rise;
+    s->magnitude = magnitude;
+    s->peak = peak;
+    s->peak_bin = peak_bin > 0 ? peak_bin : 0;     //0 for silence
+}
+
+//first bin at which the power of the bins up to it reaches target
+static int rolloff_bin(const double* power, const double* cumulative, int bins, double target){
+
+    int chunks = (bins + ROLLOFF_CHUNK - 1) / ROLLOFF_CHUNK;
+    int k = (int)(std::lower_bound(cumulative, cumulative + chunks, target) - cumulative);
+    if(target <= 0 || k >= chunks)                  //silence, or rounding put the target past the total
+        return target <= 0 ? 0 : bins - 1;
+    double sum = k > 0 ? cumulative[k-1] : 0;
+    int m = k*ROLLOFF_CHUNK;
+    int end = std::min(m + ROLLOFF_CHUNK, bins);
+    for(; m < end - 1; m++){
+        sum += power[m];
+        if(sum >= target)
+            break;
+    }
+    return m;
+}
+
+//power spectrum and features of channel c; leaves the sums of its bins and its peak in s
+static void measure_channel(Analyzer* a, int c, bool continuous, AnalyzerFeatures* f, SpectrumSums* s){
+
+    int F = a->config.fft_size;
+    int bins = F/2;
+    double hz_per_bin = (double)a->config.rate / F;
+
+    fused_spectrum(a->out + (size_t)c*out_stride(F), bins, a->power, a->previous + (size_t)c*previous_stride(F), a->cumulative, s);
+
+    //Parseval; the DC bin is the only one without a mirror image. The window scaled the power of broadband signals
+    //by its power gain, not by the square of the coherent gain the bands are corrected for
+    double mean_square = (2*s->power - a->power[0]) / ((double)F*F * a->power_gain);
+    f->rms_db = 10*log10(mean_square > BAND_FLOOR ? mean_square : BAND_FLOOR);
+    f->centroid_hz = s->power > 0 ? s->moment / s->power * hz_per_bin : 0;
+    f->rolloff_hz = rolloff_bin(a->power, a->cumulative, bins, ANALYZER_ROLLOFF * s->power) * hz_per_bin;
+    f->flux = continuous && s->magnitude > 0 ? s->rise / s->magnitude : 0;
+    f->onset = continuous && f->flux > ONSET_FLUX && f->rms_db > ONSET_FLOOR_DB
+               && f->rms_db - a->previous_rms_db[c] >= ONSET_RISE_DB;
+    a->previous_rms_db[c] = f->rms_db;
+}
+
+static void extract_into(Analyzer* a, int slot, long long block){
+
+    const BandLayout* layout = a->layout;
+    int F = a->config.fft_size;
+    int channels = a->config.channels;
+    double* power = a->power;
+    double* level = a->slots + (size_t)slot * slot_doubles(&a->config);
+    double* peak_db = level + channels * layout->bands;
+    double* peak_hz = peak_db + channels;
+    AnalyzerFeatures* features = a->features + (size_t)slot * channels;
+    bool continuous = block == a->previous_block + 1;
+
+    for(int c=0; c<channels; c++){
+        double* dB = level + c * layout->bands;
+
+        //one pass over the bins for the power spectrum, the features and the peak; the bands only read back their own bins.
+        //squared magnitudes only: the log is taken once per band, not once per bin
+        SpectrumSums s;
+        measure_channel(a, c, continuous, &features[c], &s);
+
+        if(layout->weight != NULL){                 //a weighted average of the power around each band's centre
+            for(int g=0; g<layout->bands; g++){
+                double p = segment_dot(power + layout->first[g], layout->weight + layout->weight_at[g], layout->last[g] - layout->first[g]);
+                dB[g] = 5*log10(p > BAND_FLOOR ? p : BAND_FLOOR);
+            }
+        }
+        else{
+            for(int g=0; g<layout->bands; g++)
+                dB[g] = 5*log10(segment_max(power, layout->first[g], layout->last[g]));   //10*log10(sqrt(p))
+        }
+
+        peak_db[c] = 5*log10(s.peak);
+        peak_hz[c] = (double)s.peak_bin * a->config.rate / F;
+    }
+    a->previous_block = block;
+}
+
+void analyzer_load(Analyzer* a, const uint8_t* data, size_t bytes){
+
+    int F = a->config.fft_size;
+    int stride = in_stride(F);
+    int frames = (int)std::min(bytes / a->frame_bytes, (size_t)F);
+
+    //channel c of frame f goes to in[c*in_stride(F) + f]; the first sample of a frame is the left channel
+    a->deinterleave(data, frames, a->config.channels, a->in, stride);
+
+    for(int c=0; c<a->config.channels; c++){
+        double* row = a->in + (size_t)c*stride;
+        if(frames < F)                              //the blocks at the end of a stream run past it and are zero padded
+            memset(row + frames, 0, sizeof(double)*(F - frames));
+        if(a->window != NULL){
+            const double* w = a->window;
+            for(int f=0; f<frames; f++)
+                row[f] *= w[f];
+        }
+    }
+}
+
+void analyzer_transform(Analyzer* a){
+
+    //plans are shared between analyzers, so they are always run on the analyzer's own arrays.
+    //arena allocations all start on a cache line, which is the alignment the plan was made with.
+    fftw_execute_dft_r2c(a->plan, a->in, a->out);
+}
+
+void analyzer_extract(Analyzer* a, long long block, AnalyzerFrame* frame){
+
+    extract_into(a, a->config.queue, block);        //the scratch slot
+    frame_from_slot(a, a->config.queue, block, frame);
+}
+
+void analyzer_prime(Analyzer* a, const uint8_t* data, size_t bytes, long long block){
+
+    AnalyzerFeatures unused;
+    SpectrumSums sums;
+    analyzer_load(a, data, bytes);
+    analyzer_transform(a);
+    for(int c=0; c<a->config.channels; c++)
+        measure_channel(a, c, false, &unused, &sums);
+    a->previous_block = block;
+}
+
+long long analyzer_previous_block(const Analyzer* a){
+
+    return a->previous_block;
+}
+
+void analyzer_block(Analyzer* a, const uint8_t* data, size_t bytes, long long block, AnalyzerFrame* frame){
+
+    analyzer_load(a, data, bytes);
+    analyzer_transform(a);
+    analyzer_extract(a, block, frame);
+}
+
+//analyzes the front of the pending PCM into the next free queue slot
+static void queue_pending(Analyzer* a){
+
+    int slot = (a->head + a->count) % a->config.queue;
+    analyzer_load(a, a->pending, a->pending_bytes);
+    analyzer_transform(a);
+    extract_into(a, slot, a->next_block);
+    a->slot_block[slot] = a->next_block++;
+    a->count++;
+
+    size_t hop = std::min(analyzer_hop_bytes(a), a->pending_bytes);
+    memmove(a->pending, a->pending + hop, a->pending_bytes - hop);
+    a->pending_bytes -= hop;
+}
+
+size_t analyzer_push(Analyzer* a, const uint8_t* data, size_t bytes){
+
+    if(a->config.queue == 0)
+        return 0;                                   //created for analyzer_block() only, there is nowhere to hold the PCM
+    size_t window = analyzer_window_bytes(a);
+    size_t taken = 0;
+
+    for(;;){
+        while(a->pending_bytes == window && a->count < a->config.queue)
+            queue_pending(a);
+        if(taken == bytes || a->pending_bytes == window)
+            return taken;                           //all of it, or the queue is full
+        size_t n = std::min(window - a->pending_bytes, bytes - taken);
+        memcpy(a->pending + a->pending_bytes, data + taken, n);
+        a->pending_bytes += n;
+        taken += n;
+    }
+}
+
+bool analyzer_flush(Analyzer* a){
+
+    if(a->config.queue == 0)
+        return true;                                //nothing can have been pushed
+    //every block that starts inside the stream, like the player's last blocks of a file
+    while(a->pending_bytes > 0 && a->count < a->config.queue)
+        queue_pending(a);
+    return a->pending_bytes == 0;
+}
+
+bool analyzer_pull(Analyzer* a, AnalyzerFrame* frame){
+
+    if(a->config.queue == 0 || a->count == 0)
+        return false;
+    frame_from_slot(a, a->head, a->slot_block[a->head], frame);
+    a->head = (a->head + 1) % a->config.queue;
+    a->count--;
+    return true;
+}
+
+void analyzer_reset(Analyzer* a){
+
+    a->pending_bytes = 0;
+    a->next_block = 0;
+    a->head = 0;
+    a->count = 0;
+    //block 0 follows silence
+    memset(a->previous, 0, sizeof(double) * previous_stride(a->config.fft_size) * a->config.channels);
+    for(int c=0; c<ANALYZER_MAX_CHANNELS; c++)
+        a->previous_rms_db[c] = 10*log10(BAND_FLOOR);
+    a->previous_block = -1;
+}
+
+void analyzer_set_planner(unsigned flags){
+
+    pthread_mutex_lock(&shared_mutex);
+    planner_flags = flags;
+    pthread_mutex_unlock(&shared_mutex);
+}
+
+void analyzer_import_wisdom(const char* path){
+
+    pthread_mutex_lock(&shared_mutex);
+    fftw_import_wisdom_from_filename(path);         //a missing or stale file just means we plan from scratch
+    pthread_mutex_unlock(&shared_mutex);
+}
+
+bool analyzer_export_wisdom(const char* path){
+
+    bool ok = true;
+    pthread_mutex_lock(&shared_mutex);
+    if(wisdom_dirty){
+        ok = fftw_export_wisdom_to_filename(path) != 0;
+        wisdom_dirty = false;
+    }
+    pthread_mutex_unlock(&shared_mutex);
+    return ok;
+}
+
+void analyzer_shutdown(){
+
+    pthread_mutex_lock(&shared_mutex);
+    for(size_t i=0; i<plan_cache.size(); ++i)
+        fftw_destroy_plan(plan_cache[i].p);
+    plan_cache.clear();
+    for(size_t i=0; i<band_layouts.size(); i++){
+        delete [] band_layouts[i]->edges;
+        delete [] band_layouts[i]->bin_band;
+        delete [] band_layouts[i]->first;
+        delete [] band_layouts[i]->last;
+        delete [] band_layouts[i]->weight;
+        delete [] band_layouts[i]->weight_at;
+        delete band_layouts[i];
+    }
+    band_layouts.clear();
+    pthread_mutex_unlock(&shared_mutex);
+}
@@ -0,0 +1,132 @@
+/*
+                                        -ANALYZER-
+
+    The parse / fft / band extraction pipeline of the visualizer as a library with no global state of its own.
+
+    An Analyzer owns everything a stream needs: planar input, fft output, power spectrum, window, pending PCM, the
+    previous block's spectrum and the frames it has produced. All of it is carved out of one arena when the analyzer is created, so the memory of
+    a stream is known up front (analyzer_size()) and streams never share a buffer. What doesn't depend on the stream
+    is shared by every analyzer in the process: fftw plans, one per (FFT size, channels), and band layouts, one per
+    (rate, FFT size, bands). Both are built on first use under a mutex and are read-only afterwards.
+
+    An analyzer is used by one thread at a time; any number of them can run on different threads.
+
+        streaming:      analyzer_push() PCM as it arrives, analyzer_pull() frames until it returns false,
+                        analyzer_flush() at the end of the stream for the last, zero padded, blocks
+        random access:  analyzer_block() analyzes one window of PCM from wherever it is
+*/
+
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+static const int        ANALYZER_MAX_CHANNELS = 8;
+static const int        ANALYZER_MAX_BANDS = 256;
+static const int        ANALYZER_DEFAULT_BANDS = 5; //19-140, 140-400, 400-2600, 2600-5200 Hz and 5200 Hz-Nyquist
+static const double     ANALYZER_ROLLOFF = 0.85;    //fraction of the power below the rolloff frequency
+static const size_t     ARENA_ALIGN = 64;           //every arena allocation starts on a cache line, which is also enough for any SIMD load
+
+
+enum SampleFormat                       //how interleaved samples are stored
+{
+    FORMAT_UNKNOWN = 0,
+    FORMAT_U8,
+    FORMAT_S16LE, FORMAT_S16BE,
+    FORMAT_U16LE, FORMAT_U16BE,
+    FORMAT_S24LE, FORMAT_S24BE,
+    FORMAT_S32LE, FORMAT_S32BE,
+    FORMAT_F32LE, FORMAT_F32BE
+};
+
+enum WindowType                         //analysis window applied before the fft
+{
+    WINDOW_RECT,                        //no window
+    WINDOW_HANN,
+    WINDOW_BLACKMAN
+};
+
+struct AnalyzerConfig
+{
+    int             rate;               //sample frames per second
+    int             channels;           //1 .. ANALYZER_MAX_CHANNELS
+    SampleFormat    format;
+    int             fft_size;           //frames per block, even
+    int             hop;                //frames between the starts of two blocks, 1 .. fft_size
+    WindowType      window;
+    int             bands;              //0: the default layout; otherwise log spaced from 20 Hz up to Nyquist
+    bool            weighted;           //bands are weighted averages around their centres instead of their loudest bin
+    int             queue;              //frames analyzer_push() holds until they are pulled, 0 when only analyzer_block() is used
+};
+
+struct AnalyzerFeatures                 //spectral features of one channel, from the same pass over the spectrum as the bands and the peak
+{
+    double          rms_db;             //level of the block in dBFS, the same whatever the window
+    double          centroid_hz;        //power weighted mean frequency
+    double          rolloff_hz;         //frequency below which ANALYZER_ROLLOFF of the power lies
+    double          flux;               //0 .. 1: the part of the magnitude spectrum that rose since the previous block
+    bool            onset;              //the block starts a note or a beat: a large flux and a rise in level
+};
+
+struct AnalyzerFrame                    //one analyzed block; the arrays belong to the analyzer and stay valid until it analyzes again
+{
+    long long       block;              //index of the block; it starts hop*block frames into the stream
+    int             channels;
+    int             bands;
+    const double*   level;              //[channel][band] band level in dB (10*log10 of the magnitude)
+    const double*   peak_db;            //[channel] level of the loudest bin in dB
+    const double*   peak_hz;            //[channel] frequency of the loudest bin
+    const AnalyzerFeatures* features;   //[channel]
+};
+
+struct Arena                            //bump allocator: one allocation, handed out front to back, freed all at once
+{
+    uint8_t*        base;
+    size_t          size;
+    size_t          used;
+    bool            owned;              //base was allocated by arena_init()
+};
+
+struct Analyzer;
+
+bool arena_init(Arena*, size_t);                    //allocates an arena of the given bytes, false when there's no memory
+void arena_wrap(Arena*, void*, size_t);             //an arena over memory the caller owns, ARENA_ALIGN aligned
+void* arena_alloc(Arena*, size_t);                  //ARENA_ALIGN aligned bytes, NULL when the arena is full
+void arena_release(Arena*);                         //frees the memory if arena_init() allocated it
+
+size_t analyzer_size(const AnalyzerConfig*);        //arena bytes one analyzer with this configuration takes, 0 if the configuration is invalid
+Analyzer* analyzer_create(const AnalyzerConfig*, Arena*);  //carves an analyzer out of the arena, or out of an arena of its own when
+                                                    //it is NULL; NULL when the configuration is invalid or the arena too small
+void analyzer_destroy(Analyzer*);                   //frees its own arena; with a caller's arena there's nothing to free
+const AnalyzerConfig* analyzer_config(const Analyzer*);
+size_t analyzer_window_bytes(const Analyzer*);      //bytes of PCM one block covers: fft_size frames
+size_t analyzer_hop_bytes(const Analyzer*);         //bytes between the starts of two blocks: hop frames
+const double* analyzer_band_edges(const Analyzer*); //bands+1 edges in Hz
+
+size_t analyzer_push(Analyzer*, const uint8_t*, size_t);   //takes PCM and analyzes every block it completes; returns the bytes taken,
+                                                    //fewer when the frame queue is full: pull and push the rest; always 0 when queue is 0
+bool analyzer_flush(Analyzer*);                     //end of stream: analyzes the blocks that start in the pending PCM, zero padded;
+                                                    //false while the frame queue is too full for all of them: pull and flush again
+bool analyzer_pull(Analyzer*, AnalyzerFrame*);      //the oldest frame not pulled yet, false when there is none
+void analyzer_reset(Analyzer*);                     //drops pending PCM, frames and the previous spectrum; the next push starts block 0
+
+void analyzer_block(Analyzer*, const uint8_t*, size_t, long long, AnalyzerFrame*);  //analyzes up to one window of PCM as the given block,
+                                                    //zero padded; the three stages below in a row
+void analyzer_load(Analyzer*, const uint8_t*, size_t);  //stage 1: deinterleaves into planar doubles, pads and applies the window
+void analyzer_transform(Analyzer*);                 //stage 2: one real-to-complex fft of every channel
+void analyzer_extract(Analyzer*, long long, AnalyzerFrame*);   //stage 3: band levels, peak and features of every channel. The flux
+                                                    //is measured against the previous block's spectrum; it is 0 when the
+                                                    //last block analyzed wasn't the one before (block 0 follows silence)
+void analyzer_prime(Analyzer*, const uint8_t*, size_t, long long);  //only remembers the spectrum of a block, so the flux of the
+                                                    //next one can be measured after a jump
+long long analyzer_previous_block(const Analyzer*); //the block the next flux is measured against, -1 before block 0
+
+int analyzer_make_band_edges(int, int, double*);    //the edges a configuration with (rate, bands) uses; returns the number of bands
+void analyzer_set_planner(unsigned);                //FFTW_MEASURE (default) or FFTW_PATIENT for plans built from now on
+void analyzer_import_wisdom(const char*);           //a missing or stale file just means plans are built from scratch
+bool analyzer_export_wisdom(const char*);           //writes the wisdom if new plans were built since the last export; false on error
+void analyzer_shutdown();                           //destroys the shared plans and band layouts; no analyzer may be in use
+
+#endif
@@ -0,0 +1,330 @@
+/*
+                                        -BENCHMARK-
+
+    Times each stage of the analysis and display pipeline on synthetic audio:
+    parse (deinterleave into planar doubles), fft, analyze (bands, peak and spectral features),
+    bars (building the '|' strings) and render (composing and diffing a frame).
+
+    The player is compiled into this file and linked with the analyzer, so every stage runs exactly the code the player runs.
+    "make bench" builds it; "make pgo" uses it as the training run of the profile guided build.
+
+    usage: ./benchmark [-t SECONDS] [-r RATE] [-c CHANNELS] [-F FORMAT] [-N FRAMES] [-H HOP] [-W WINDOW] [-i ITERATIONS] [-B BANDS|-Q BARS]
+*/
+
+#define main visualizer_main
+#include "Program_All_in_one_file.cpp"
+#undef main
+
+#include <time.h>
+
+
+static const double     DEFAULT_BENCH_SECONDS = 60;
+static const int        DEFAULT_BENCH_RATE = 44100;
+static const int        DEFAULT_BENCH_CHANNELS = 2;
+static const int        DEFAULT_BENCH_ITERATIONS = 3;   //every stage reports its fastest pass
+
+enum BenchStage
+{
+    STAGE_PARSE,
+    STAGE_FFT,
+    STAGE_ANALYZE,
+    STAGE_BARS,
+    STAGE_RENDER,
+    STAGE_COUNT
+};
+
+static const char*      STAGE_NAMES[STAGE_COUNT] = { "parse", "fft", "analyze", "bars", "render" };
+
+struct BenchFormat                      //-F names and how to write one sample of them
+{
+    const char*     name;
+    uint16_t        tag;                //WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+    int             bytes;
+    bool            big_endian;
+};
+
+static const BenchFormat BENCH_FORMATS[] = {
+    { "u8",    1, 1, false },
+    { "s16",   1, 2, false },
+    { "s16be", 1, 2, true  },
+    { "s24",   1, 3, false },
+    { "s24be", 1, 3, true  },
+    { "s32",   1, 4, false },
+    { "s32be", 1, 4, true  },
+    { "f32",   3, 4, false },
+    { "f32be", 3, 4, true  },
+};
+
+double          bench_seconds = DEFAULT_BENCH_SECONDS;
+int             bench_rate = DEFAULT_BENCH_RATE;
+int             bench_channels = DEFAULT_BENCH_CHANNELS;
+int             bench_iterations = DEFAULT_BENCH_ITERATIONS;
+const BenchFormat* bench_format = &BENCH_FORMATS[1];
+char            bench_path[] = "/tmp/visualizer-benchXXXXXX";
+
+double now_ns();                                    //monotonic clock in nanoseconds
+void put_uint(Uint8*, uint32_t, int, bool);         //stores the low bytes of a number in the given byte order
+void put_sample(Uint8*, double, const BenchFormat*);    //writes one sample in [-1, 1) in the given format
+int write_synthetic_wav(int);                       //fills the file with a RIFF/RIFX header and a few seconds of tones and noise
+int handle_bench_args(int, char**);
+void run_pipeline(double*);                         //one pass over every block, adds each stage's time to the array
+void report(const double*);
+
+
+int main(int argc, char** argv)
+{
+    if(handle_bench_args(argc, argv))
+        return 1;
+
+    int fd = mkstemp(bench_path);
+    if(fd < 0 || write_synthetic_wav(fd)){
+        std::cerr << "Error: could not write the synthetic wav file " << bench_path << std::endl;
+        return 1;
+    }
+    close(fd);
+
+    if(stft_hop == 0)
+        stft_hop = stft_size;
+    playlist.push_back(bench_path);
+    cache_enabled = false;                          //a cache hit would skip everything we want to time
+    int failed = INITIALIZE_SDL_AND_WAV_VARIABLES();
+    unlink(bench_path);                             //the mapping keeps the data alive
+    if(failed)
+        return 1;
+
+    Track* t = &tracks[0];
+    initializer_vars(t);
+    load_wisdom();
+
+    double best[STAGE_COUNT];
+    for(int s=0; s<STAGE_COUNT; s++)
+        best[s] = 1E300;
+    run_pipeline(best);                             //plans the FFT and warms the caches, not counted
+    for(int s=0; s<STAGE_COUNT; s++)
+        best[s] = 1E300;
+    for(int i=0; i<bench_iterations; i++){
+        double spent[STAGE_COUNT] = { 0 };
+        run_pipeline(spent);
+        for(int s=0; s<STAGE_COUNT; s++)
+            if(spent[s] < best[s])
+                best[s] = spent[s];
+    }
+    report(best);
+
+    save_wisdom();
+    screen_release();
+    free_track(t);
+    SDL_Quit();
+    analyzer_shutdown();
+    return 0;
+}
+
+double now_ns(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1E9 + ts.tv_nsec;
+}
+
+void put_uint(Uint8* p, uint32_t value, int bytes, bool big_endian){
+
+    for(int i=0; i<bytes; i++)
+        p[i] = (Uint8)(value >> (big_endian ? 8*(bytes - 1 - i) : 8*i));
+}
+
+void put_sample(Uint8* p, double value, const BenchFormat* format){
+
+    uint32_t u;
+    if(format->tag == 3){
+        float f = (float)value;
+        memcpy(&u, &f, 4);
+    }
+    else if(format->bytes == 1)
+        u = (uint32_t)(int)(value*127 + 128);       //8 bit wav is unsigned
+    else
+        u = (uint32_t)(int32_t)(value * (double)(1u << (format->bytes*8 - 1)));
+    put_uint(p, u, format->bytes, format->big_endian);
+}
+
+int write_synthetic_wav(int fd){
+
+    int frame_bytes = bench_format->bytes * bench_channels;
+    uint32_t frames = (uint32_t)(bench_seconds * bench_rate);
+    uint32_t data_size = frames * frame_bytes;
+    bool be = bench_format->big_endian;
+
+    Uint8 header[44];                               //canonical 44 byte header: RIFF, fmt and data chunks
+    memcpy(header, be ? "RIFX" : "RIFF", 4);
+    put_uint(header + 4, 36 + data_size, 4, be);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_uint(header + 16, 16, 4, be);
+    put_uint(header + 20, bench_format->tag, 2, be);
+    put_uint(header + 22, bench_channels, 2, be);
+    put_uint(header + 24, bench_rate, 4, be);
+    put_uint(header + 28, bench_rate*frame_bytes, 4, be);
+    put_uint(header + 32, frame_bytes, 2, be);
+    put_uint(header + 34, bench_format->bytes*8, 2, be);
+    memcpy(header + 36, "data", 4);
+    put_uint(header + 40, data_size, 4, be);
+
+    std::vector<Uint8> data((size_t)DEFAULT_SAMPLES * frame_bytes);
+    uint32_t noise = 12345;
+    if(write(fd, header, sizeof(header)) != (ssize_t)sizeof(header))
+        return 1;
+    for(uint32_t f=0; f<frames; ){
+        uint32_t chunk = frames - f < DEFAULT_SAMPLES ? frames - f : DEFAULT_SAMPLES;
+        for(uint32_t i=0; i<chunk; i++, f++){
+            double t = (double)f / bench_rate;
+            for(int c=0; c<bench_channels; c++){
+                //a bass line, a mid tone that moves between channels and some noise so every band has something in it
+                noise = noise*1664525 + 1013904223;
+                double value = 0.3*sin(2*M_PI*(60 + 20*c)*t)
+                             + 0.2*sin(2*M_PI*(440 + 110*c)*t)*sin(2*M_PI*0.5*t)
+                             + 0.1*((int32_t)noise / 2147483648.0);
+                put_sample(&data[(size_t)i*frame_bytes + c*bench_format->bytes], value, bench_format);
+            }
+        }
+        size_t bytes = (size_t)chunk*frame_bytes;
+        if(write(fd, data.data(), bytes) != (ssize_t)bytes)
+            return 1;
+    }
+    return 0;
+}
+
+int handle_bench_args(int argc, char** argv){
+
+    int opt;
+
+    while((opt = getopt(argc, argv, "t:r:c:F:N:H:W:i:B:Q:")) != -1){
+        switch(opt){
+            case 't':                                       //seconds of audio
+                        bench_seconds = atof(optarg);
+                        if(bench_seconds <= 0) goto usage;
+                        break;
+            case 'r':                                       //sample rate
+                        bench_rate = atoi(optarg);
+                        if(bench_rate <= 0) goto usage;
+                        break;
+            case 'c':                                       //channels
+                        bench_channels = atoi(optarg);
+                        if(bench_channels <= 0 || bench_channels > MAX_CHANNELS) goto usage;
+                        break;
+            case 'F':                                       //sample format
+                        bench_format = NULL;
+                        for(size_t i=0; i<sizeof(BENCH_FORMATS)/sizeof(BENCH_FORMATS[0]); i++)
+                            if(strcmp(optarg, BENCH_FORMATS[i].name) == 0)
+                                bench_format = &BENCH_FORMATS[i];
+                        if(bench_format == NULL) goto usage;
+                        break;
+            case 'N':                                       //frames per fft, the player's -n
+                        stft_size = atoi(optarg);
+                        if(stft_size < MIN_STFT_SIZE || stft_size > MAX_STFT_SIZE || stft_size % 2) goto usage;
+                        break;
+            case 'H':                                       //frames between two blocks, the player's -H
+                        stft_hop = atoi(optarg);
+                        if(stft_hop <= 0) goto usage;
+                        break;
+            case 'W':                                       //analysis window, the player's -W
+                        if(strcmp(optarg, "rect") == 0) stft_window = WINDOW_RECT;
+                        else if(strcmp(optarg, "hann") == 0) stft_window = WINDOW_HANN;
+                        else if(strcmp(optarg, "blackman") == 0) stft_window = WINDOW_BLACKMAN;
+                        else goto usage;
+                        break;
+            case 'i':                                       //passes over the file
+                        bench_iterations = atoi(optarg);
+                        if(bench_iterations <= 0) goto usage;
+                        break;
+            case 'B':                                       //log spaced bands, as in the player
+                        log_bands = atoi(optarg);
+                        if(log_bands <= 0 || log_bands > MAX_BANDS) goto usage;
+                        break;
+            case 'Q':                                       //kernel spectrum, as in the player
+                        log_bands = atoi(optarg);
+                        spectrum_view = true;
+                        if(log_bands < MIN_SPECTRUM_BARS || log_bands > MAX_BANDS) goto usage;
+                        break;
+            case '?':
+usage:
+                        fprintf(stderr, "usage: %s [-t SECONDS] [-r RATE] [-c CHANNELS] [-F u8|s16|s16be|s24|s24be|s32|s32be|f32|f32be]"
+                                        " [-N FRAMES] [-H HOP] [-W rect|hann|blackman] [-i ITERATIONS] [-B BANDS|-Q BARS]\n", argv[0] );
+                        return 1;
+        }
+    }
+    if(optind != argc || stft_hop > stft_size) goto usage;
+    return 0;
+}
+
+void run_pipeline(double* spent){
+
+    Track* t = &tracks[0];
+    const Uint8* buffer;
+    AnalyzerFrame frame;
+
+    Analyzer* analyzer = analyzer_create(&t->config, NULL);
+    for(int cc=0; analyzer != NULL && cc<t->blocks; cc++){
+        size_t bytesRead = block_bytes(t, cc, &buffer);
+
+        double t0 = now_ns();
+        analyzer_load(analyzer, buffer, bytesRead);
+        double t1 = now_ns();
+        analyzer_transform(analyzer);
+        double t2 = now_ns();
+        analyzer_extract(analyzer, cc, &frame);
+        store_frame(t, cc, frame);
+        t->analysis.ready[cc].store(1, std::memory_order_release);
+        double t3 = now_ns();
+
+        spent[STAGE_PARSE] += t1 - t0;
+        spent[STAGE_FFT] += t2 - t1;
+        spent[STAGE_ANALYZE] += t3 - t2;
+    }
+    analyzer_destroy(analyzer);
+
+    size_t drawn = 0;
+    double t0 = now_ns();
+    for(int cc=0; cc<t->blocks; cc++)
+        for(int c=0; c<t->spec.channels; c++)
+            for(int g=0; g<t->fft_results.bands; g++)
+                drawn += strlen(wav_graph(t, cc, c, g));  //use the result so the loop isn't optimized away
+    spent[STAGE_BARS] += now_ns() - t0;
+    if(drawn == (size_t)-1)
+        cout << drawn;
+
+    //frames go to /dev/null: what is timed is composing and diffing them, not the terminal
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    screen_invalidate();
+    t0 = now_ns();
+    Uint32 length = t->wavfile.data_size;
+    for(int cc=0; cc<t->blocks; cc++){
+        screen_begin_frame();
+        printstats(t, cc, length - (Uint32)((size_t)cc*t->block_size < length ? cc*t->block_size : length));
+        printwaveform(t, cc);
+        screen_end_frame();
+    }
+    spent[STAGE_RENDER] += now_ns() - t0;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(devnull);
+}
+
+void report(const double* best){
+
+    const Track* t = &tracks[0];
+    double mb = t->wavfile.data_size / 1E6;
+    double total = 0;
+
+    printf("%d blocks of %d frames (hop %d), %d channels, %s, %d Hz, %.1f sec, %d bands, best of %d\n",
+           t->blocks, stft_size, stft_hop, t->spec.channels, bench_format->name, bench_rate, bench_seconds,
+           t->fft_results.bands, bench_iterations);
+    printf("%-10s %12s %14s %14s %12s\n", "stage", "total (ms)", "per block (ns)", "blocks/s", "MB/s");
+    for(int s=0; s<=STAGE_COUNT; s++){
+        double ns = s < STAGE_COUNT ? best[s] : total;
+        if(s < STAGE_COUNT)
+            total += ns;
+        printf("%-10s %12.3f %14.0f %14.0f %12.1f\n", s < STAGE_COUNT ? STAGE_NAMES[s] : "all",
+               ns/1E6, ns/t->blocks, t->blocks/(ns/1E9), mb/(ns/1E9));
+    }
+}
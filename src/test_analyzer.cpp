@@ -0,0 +1,333 @@
+/*
+                                        -ANALYZER TESTS-
+
+    Regression tests of the analyzer library (analyzer.h) on synthetic PCM. Every test prints what failed and
+    returns the number of failures; main runs them all and exits with 1 if any failed.
+
+    "make test" builds and runs it together with the player's tests.
+*/
+
+#include "analyzer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+
+static const double     TEST_TOLERANCE = 1E-9;      //the same code on the same samples, only the order of the calls differs
+static const int        TEST_RATE = 8000;
+static const int        TEST_FRAMES = 5000;         //not a multiple of any hop below, so the last blocks are zero padded
+
+typedef int (*TestFunction)();
+
+struct TestCase
+{
+    const char*     name;
+    TestFunction    run;
+};
+
+void put_sample(uint8_t*, double, SampleFormat);    //writes one sample in [-1, 1) in the given format
+std::vector<uint8_t> make_pcm(const AnalyzerConfig*, double);   //TEST_FRAMES of a tone per channel plus some noise; the frequency sets them apart
+bool same_frame(const AnalyzerFrame*, const AnalyzerFrame*);    //every level, peak and feature within TEST_TOLERANCE
+int test_no_queue();                                //push, flush and pull of an analyzer made for analyzer_block() only
+int test_shared_arena_streams();                    //two streams on one caller-owned arena, pushed in turns, against analyzer_block()
+int test_rms_window();                              //the RMS of a sine is its amplitude over sqrt(2) with every window
+int test_peak_bin();                                //the peak is the loudest bin of a plain DFT, at any size
+int test_u16_formats();                             //unsigned 16 bit, either byte order, gives what signed 16 bit gives
+
+static const TestCase   TESTS[] = {
+    { "no queue",                test_no_queue },
+    { "shared arena streams",    test_shared_arena_streams },
+    { "rms whatever the window", test_rms_window },
+    { "peak bin",                test_peak_bin },
+    { "u16 like s16",            test_u16_formats },
+};
+
+
+int main()
+{
+    int failed = 0;
+    for(size_t i=0; i<sizeof(TESTS)/sizeof(TESTS[0]); i++){
+        int f = TESTS[i].run();
+        printf("%-28s %s\n", TESTS[i].name, f ? "FAILED" : "ok");
+        failed += f;
+    }
+    analyzer_shutdown();
+    return failed ? 1 : 0;
+}
+
+void put_sample(uint8_t* p, double value, SampleFormat format){
+
+    switch(format){
+        case FORMAT_S16LE: {
+            int16_t s = (int16_t)(value*32767);
+            p[0] = (uint8_t)s;
+            p[1] = (uint8_t)(s >> 8);
+            break;
+        }
+        case FORMAT_U16LE:
+        case FORMAT_U16BE: {
+            uint16_t u = (uint16_t)((int)(value*32767) + 32768);
+            p[format == FORMAT_U16LE ? 0 : 1] = (uint8_t)u;
+            p[format == FORMAT_U16LE ? 1 : 0] = (uint8_t)(u >> 8);
+            break;
+        }
+        case FORMAT_F32LE: {
+            float f = (float)value;
+            uint32_t u;
+            memcpy(&u, &f, 4);
+            for(int i=0; i<4; i++)
+                p[i] = (uint8_t)(u >> 8*i);
+            break;
+        }
+        default:
+            fprintf(stderr, "put_sample: format %d is not written by the tests\n", (int)format);
+            abort();
+    }
+}
+
+std::vector<uint8_t> make_pcm(const AnalyzerConfig* c, double base_hz){
+
+    int sample = c->format == FORMAT_F32LE ? 4 : 2;
+    std::vector<uint8_t> pcm((size_t)TEST_FRAMES * c->channels * sample);
+    uint32_t noise = 12345;
+    for(int f=0; f<TEST_FRAMES; f++)
+        for(int ch=0; ch<c->channels; ch++){
+            noise = noise*1664525 + 1013904223;
+            double t = (double)f / c->rate;
+            //the tone swells halfway through, so there is an onset and the flux isn't flat
+            double value = (f < TEST_FRAMES/2 ? 0.1 : 0.5) * sin(2*M_PI*base_hz*(ch + 1)*t)
+                         + 0.01*((int32_t)noise / 2147483648.0);
+            put_sample(&pcm[((size_t)f*c->channels + ch)*sample], value, c->format);
+        }
+    return pcm;
+}
+
+bool same_frame(const AnalyzerFrame* a, const AnalyzerFrame* b){
+
+    if(a->block != b->block || a->channels != b->channels || a->bands != b->bands)
+        return false;
+    for(int c=0; c<a->channels; c++){
+        for(int g=0; g<a->bands; g++)
+            if(fabs(a->level[c*a->bands + g] - b->level[c*b->bands + g]) > TEST_TOLERANCE)
+                return false;
+        const AnalyzerFeatures* x = &a->features[c];
+        const AnalyzerFeatures* y = &b->features[c];
+        if(fabs(a->peak_db[c] - b->peak_db[c]) > TEST_TOLERANCE || a->peak_hz[c] != b->peak_hz[c]
+           || fabs(x->rms_db - y->rms_db) > TEST_TOLERANCE || fabs(x->centroid_hz - y->centroid_hz) > TEST_TOLERANCE
+           || fabs(x->rolloff_hz - y->rolloff_hz) > TEST_TOLERANCE || fabs(x->flux - y->flux) > TEST_TOLERANCE
+           || x->onset != y->onset)
+            return false;
+    }
+    return true;
+}
+
+int test_no_queue(){
+
+    AnalyzerConfig c = { TEST_RATE, 2, FORMAT_S16LE, 256, 128, WINDOW_HANN, 0, false, 0 };
+    Analyzer* a = analyzer_create(&c, NULL);
+    if(a == NULL){
+        printf("  no queue: analyzer_create failed\n");
+        return 1;
+    }
+    std::vector<uint8_t> pcm = make_pcm(&c, 440);
+    AnalyzerFrame frame;
+    int failed = 0;
+    if(analyzer_push(a, pcm.data(), pcm.size()) != 0){
+        printf("  no queue: analyzer_push took PCM it has nowhere to keep\n");
+        failed++;
+    }
+    if(!analyzer_flush(a) || analyzer_pull(a, &frame)){
+        printf("  no queue: flush or pull saw a frame that was never queued\n");
+        failed++;
+    }
+    analyzer_block(a, pcm.data(), analyzer_window_bytes(a), 0, &frame);   //still fine for random access
+    if(frame.block != 0 || frame.peak_hz[0] <= 0){
+        printf("  no queue: analyzer_block after the push returned no frame\n");
+        failed++;
+    }
+    analyzer_destroy(a);
+    return failed;
+}
+
+int test_shared_arena_streams(){
+
+    //two unrelated streams: different formats, channels, windows and hops; queues short enough to fill
+    AnalyzerConfig config[2] = {
+        { TEST_RATE, 2, FORMAT_S16LE, 256, 100, WINDOW_HANN, 0, false, 3 },
+        { TEST_RATE, 1, FORMAT_F32LE, 512, 512, WINDOW_BLACKMAN, 16, true, 2 },
+    };
+    std::vector<uint8_t> pcm[2] = { make_pcm(&config[0], 440), make_pcm(&config[1], 1000) };
+
+    size_t size = analyzer_size(&config[0]) + analyzer_size(&config[1]);
+    void* memory = NULL;
+    if(posix_memalign(&memory, ARENA_ALIGN, size)){
+        printf("  shared arena: no memory\n");
+        return 1;
+    }
+    Arena arena;
+    arena_wrap(&arena, memory, size);
+    Analyzer* stream[2] = { analyzer_create(&config[0], &arena), analyzer_create(&config[1], &arena) };
+    Analyzer* reference[2] = { analyzer_create(&config[0], NULL), analyzer_create(&config[1], NULL) };
+    int failed = 0;
+    if(!stream[0] || !stream[1] || !reference[0] || !reference[1] || arena.used > size){
+        printf("  shared arena: analyzer_create failed, %zu of %zu arena bytes used\n", arena.used, size);
+        failed++;
+    }
+
+    size_t taken[2] = { 0, 0 };
+    long long pulled[2] = { 0, 0 };
+    bool flushed[2] = { false, false };
+    const size_t chunk[2] = { 37, 301 };            //pieces that split frames and samples
+    while(!failed && !(flushed[0] && flushed[1])){
+        for(int s=0; s<2 && !failed; s++){          //one piece of each stream in turn, like two callbacks on one thread
+            if(taken[s] < pcm[s].size())
+                taken[s] += analyzer_push(stream[s], &pcm[s][taken[s]], std::min(chunk[s], pcm[s].size() - taken[s]));
+            else
+                flushed[s] = analyzer_flush(stream[s]);
+
+            AnalyzerFrame got, expected;
+            while(!failed && analyzer_pull(stream[s], &got)){
+                size_t offset = (size_t)got.block * analyzer_hop_bytes(stream[s]);
+                analyzer_block(reference[s], &pcm[s][offset], std::min(analyzer_window_bytes(stream[s]), pcm[s].size() - offset),
+                               got.block, &expected);
+                if(got.block != pulled[s] || !same_frame(&got, &expected)){
+                    printf("  shared arena: stream %d block %lld (expected block %lld) differs from analyzer_block\n", s, got.block, pulled[s]);
+                    failed++;
+                }
+                pulled[s]++;
+            }
+        }
+    }
+
+    for(int s=0; s<2 && !failed; s++){
+        long long hop = config[s].hop;
+        if(pulled[s] != (TEST_FRAMES + hop - 1) / hop){
+            printf("  shared arena: stream %d gave %lld frames, %lld blocks start in it\n", s, pulled[s], (TEST_FRAMES + hop - 1) / hop);
+            failed++;
+        }
+    }
+    for(int s=0; s<2; s++){
+        analyzer_destroy(stream[s]);
+        analyzer_destroy(reference[s]);
+    }
+    arena_release(&arena);                          //not ours to free: a no-op
+    free(memory);
+    return failed;
+}
+
+int test_rms_window(){
+
+    const WindowType windows[] = { WINDOW_RECT, WINDOW_HANN, WINDOW_BLACKMAN };
+    const char* names[] = { "rect", "hann", "blackman" };
+    const double amplitude = 0.488;
+    const int F = 1024;
+    double expected = 20*log10(amplitude / sqrt(2.0));
+    int failed = 0;
+
+    for(int w=0; w<3; w++){
+        AnalyzerConfig c = { TEST_RATE, 1, FORMAT_F32LE, F, F, windows[w], 0, false, 0 };
+        Analyzer* a = analyzer_create(&c, NULL);
+        std::vector<uint8_t> pcm((size_t)F * 4);
+        for(int f=0; f<F; f++)                      //50 whole periods: no leakage to blame
+            put_sample(&pcm[(size_t)f*4], amplitude * sin(2*M_PI*50*f/F), c.format);
+        AnalyzerFrame frame;
+        analyzer_block(a, pcm.data(), pcm.size(), 0, &frame);
+        if(fabs(frame.features[0].rms_db - expected) > 0.01){
+            printf("  rms: %s window gives %.2f dB, expected %.2f dB\n", names[w], frame.features[0].rms_db, expected);
+            failed++;
+        }
+        analyzer_destroy(a);
+    }
+    return failed;
+}
+
+int test_peak_bin(){
+
+    const int sizes[] = { 18, 34, 512, 1000 };     //not only powers of two
+    const int trials = 24;
+    int failed = 0;
+
+    for(int i=0; i<4; i++){
+        const int F = sizes[i];
+        AnalyzerConfig c = { TEST_RATE, 2, FORMAT_F32LE, F, F, WINDOW_RECT, 0, false, 0 };
+        Analyzer* a = analyzer_create(&c, NULL);
+        std::vector<uint8_t> pcm((size_t)F * 2 * 4);
+        uint32_t noise = 7;
+        for(int trial=0; trial<trials; trial++){
+            //silence, noise, two tones of different levels; the second channel has its tone in the last bin or is all DC
+            int mode = trial % 4;
+            for(int f=0; f<F; f++){
+                noise = noise*1664525 + 1013904223;
+                double phase = 2*M_PI*f/F;
+                double left = mode == 0 ? 0 : mode == 1 ? (int32_t)noise / 2147483648.0
+                            : 0.3*cos(phase*((trial*7) % (F/2))) + 0.2*cos(phase*((trial*3 + 1) % (F/2)));
+                double right = mode == 3 ? 0.5 : 0.2*cos(phase*(F/2 - 1));
+                put_sample(&pcm[(size_t)f*8], left, c.format);
+                put_sample(&pcm[(size_t)f*8 + 4], right, c.format);
+            }
+            AnalyzerFrame frame;
+            analyzer_block(a, pcm.data(), pcm.size(), trial, &frame);
+
+            for(int ch=0; ch<2; ch++){
+                //the first of the loudest bins below Nyquist, as a plain DFT of the same floats finds it
+                double best = 0;
+                int bin = 0;
+                for(int k=0; k<F/2; k++){
+                    double re = 0, im = 0;
+                    for(int f=0; f<F; f++){
+                        float x;
+                        memcpy(&x, &pcm[(size_t)f*8 + ch*4], 4);
+                        re += x*cos(2*M_PI*k*f/F);
+                        im -= x*sin(2*M_PI*k*f/F);
+                    }
+                    double power = re*re + im*im;
+                    if(power > best*(1 + 1E-9) + 1E-20){
+                        best = power;
+                        bin = k;
+                    }
+                }
+                double hz = (double)bin*TEST_RATE/F;
+                if(fabs(frame.peak_hz[ch] - hz) > TEST_TOLERANCE){
+                    printf("  peak: size %d trial %d channel %d at %.1f Hz, the DFT says %.1f Hz\n", F, trial, ch, frame.peak_hz[ch], hz);
+                    failed++;
+                }
+            }
+        }
+        analyzer_destroy(a);
+    }
+    return failed;
+}
+
+int test_u16_formats(){
+
+    //stereo, so the vector kernels take them where there are any
+    const SampleFormat formats[] = { FORMAT_S16LE, FORMAT_U16LE, FORMAT_U16BE };
+    const int F = 512;
+    AnalyzerFrame frame[3];
+    Analyzer* a[3];
+    std::vector<uint8_t> pcm[3];
+    int failed = 0;
+
+    for(int k=0; k<3; k++){
+        AnalyzerConfig c = { TEST_RATE, 2, formats[k], F, F, WINDOW_HANN, 0, false, 0 };
+        a[k] = analyzer_create(&c, NULL);
+        pcm[k].resize((size_t)F * 2 * 2);
+        for(int f=0; f<F; f++)
+            for(int ch=0; ch<2; ch++)
+                put_sample(&pcm[k][((size_t)f*2 + ch)*2], (ch ? 0.2 : 0.4)*sin(2*M_PI*1000*f/TEST_RATE), formats[k]);
+        analyzer_block(a[k], pcm[k].data(), pcm[k].size(), 0, &frame[k]);
+    }
+    for(int k=1; k<3; k++)
+        if(!same_frame(&frame[k], &frame[0])){
+            printf("  u16: format %d differs from s16 (rms %.4f dB, s16 %.4f dB)\n", (int)formats[k],
+                   frame[k].features[0].rms_db, frame[0].features[0].rms_db);
+            failed++;
+        }
+    for(int k=0; k<3; k++)
+        analyzer_destroy(a[k]);
+    return failed;
+}
@@ -0,0 +1,539 @@
+/*
+                                        -PLAYER TESTS-
+
+    Regression and stress tests of the player's concurrent pieces on a synthetic wav file: the playback snapshot
+    seqlock, the transport queue, the work-stealing analysis pool, the analysis cache, the live input ring's arrival
+    stamps and the batch output. Every test prints what failed and returns the number of failures.
+
+    The player is compiled into this file, like the benchmark, so every test runs the code the player runs.
+    "make test" builds and runs it after the analyzer's tests.
+*/
+
+#define main visualizer_main
+#include "Program_All_in_one_file.cpp"
+#undef main
+
+
+static const int        TEST_RATE = 8000;
+static const int        TEST_CHANNELS = 2;
+static const int        TEST_SECONDS = 10;
+static const int        TEST_STFT_SIZE = 512;
+static const int        TEST_STFT_HOP = 256;        //overlapped, so every block's flux depends on the block before
+static const int        TEST_POOL_WORKERS = 4;
+static const uint64_t   SNAPSHOT_TEST_NS = 500000000;   //long enough for the scheduler to stop both sides mid-copy, even on one core
+static const int        STEAL_BLOCKS = 100000;
+static const int        STEAL_THREADS = 4;
+static const double     TEST_TOLERANCE = 1E-5;      //relative; results are stored as float
+
+typedef int (*TestFunction)();
+
+struct TestCase
+{
+    const char*     name;
+    TestFunction    run;
+};
+
+struct StealCheck                       //what every thread of test_work_stealing() shares
+{
+    std::atomic<int>*   taken;          //[STEAL_BLOCKS] times each block was handed out
+};
+
+char            test_dir[] = "/tmp/visualizer-testXXXXXX";
+char            test_wav[sizeof(test_dir) + 16];
+std::atomic<bool> reader_done(false);
+StealCheck      steal_check;
+
+void put_uint(Uint8*, uint32_t, int);               //stores the low bytes of a number, little endian
+int write_test_wav(const char*);                    //TEST_SECONDS of s16 stereo tones that swell, plus noise, 0 on success
+bool close_to(double, double);                      //within TEST_TOLERANCE of the expected value, relative to it above 1
+int load_test_track(Track*);                        //maps the test file into the track and sets up its fft_results
+int compare_with_sequential(const Track*);          //every block of fft_results against one analyzer run front to back
+int test_snapshot_seqlock();                        //the render thread never sees half of a snapshot, or an older one
+int test_transport_queue();                         //commands arrive in order, a full queue refuses and reports them
+int test_pool_matches_sequential();                 //the pool, stealing and priming the flux, gives the sequential results
+int test_work_stealing();                           //threads that take and steal hand out every block exactly once
+int test_analysis_cache();                          //a stored analysis maps back unchanged; changed content misses
+int test_ring_arrival();                            //live blocks are stamped with the write that brought their last byte
+int test_batch_csv();                               //quoting, negative band levels and peak frequencies above 65535 Hz
+void* snapshot_writer(void *arg);
+void* steal_worker(void *arg);
+
+static const TestCase   TESTS[] = {
+    { "snapshot seqlock",        test_snapshot_seqlock },
+    { "transport queue",         test_transport_queue },
+    { "pool matches sequential", test_pool_matches_sequential },
+    { "work stealing",           test_work_stealing },
+    { "analysis cache",          test_analysis_cache },
+    { "ring arrival",            test_ring_arrival },
+    { "batch csv",               test_batch_csv },
+};
+
+
+int main()
+{
+    if(mkdtemp(test_dir) == NULL){
+        std::cerr << "Error: could not create a directory for the tests" << std::endl;
+        return 1;
+    }
+    snprintf(test_wav, sizeof(test_wav), "%s/test.wav", test_dir);
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", test_dir);
+    snprintf(wisdom_path, sizeof(wisdom_path), "%s/wisdom", test_dir);   //never the user's files
+    stft_size = TEST_STFT_SIZE;
+    stft_hop = TEST_STFT_HOP;
+    stft_window = WINDOW_HANN;
+    cache_enabled = false;                          //only test_analysis_cache() writes one
+    if(write_test_wav(test_wav)){
+        std::cerr << "Error: could not write " << test_wav << std::endl;
+        return 1;
+    }
+
+    int failed = 0;
+    for(size_t i=0; i<sizeof(TESTS)/sizeof(TESTS[0]); i++){
+        int f = TESTS[i].run();
+        printf("%-28s %s\n", TESTS[i].name, f ? "FAILED" : "ok");
+        failed += f;
+    }
+
+    free_track(&tracks[0]);
+    release_stats();
+    analyzer_shutdown();
+    char command[sizeof(test_dir) + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", test_dir);
+    if(system(command) != 0)
+        std::cerr << "Warning: could not remove " << test_dir << std::endl;
+    return failed ? 1 : 0;
+}
+
+void put_uint(Uint8* p, uint32_t value, int bytes){
+
+    for(int i=0; i<bytes; i++)
+        p[i] = (Uint8)(value >> 8*i);
+}
+
+int write_test_wav(const char* path){
+
+    uint32_t frames = TEST_RATE * TEST_SECONDS;
+    int frame_bytes = 2 * TEST_CHANNELS;
+    uint32_t data_size = frames * frame_bytes;
+    std::vector<Uint8> file(44 + data_size);
+    Uint8* header = file.data();
+
+    memcpy(header, "RIFF", 4);
+    put_uint(header + 4, 36 + data_size, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_uint(header + 16, 16, 4);
+    put_uint(header + 20, 1, 2);                    //WAVE_FORMAT_PCM
+    put_uint(header + 22, TEST_CHANNELS, 2);
+    put_uint(header + 24, TEST_RATE, 4);
+    put_uint(header + 28, TEST_RATE*frame_bytes, 4);
+    put_uint(header + 32, frame_bytes, 2);
+    put_uint(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    put_uint(header + 40, data_size, 4);
+
+    uint32_t noise = 12345;
+    for(uint32_t f=0; f<frames; f++){
+        double t = (double)f / TEST_RATE;
+        for(int c=0; c<TEST_CHANNELS; c++){
+            //a note every half second, so there are onsets and the flux moves
+            noise = noise*1664525 + 1013904223;
+            double swell = fmod(t, 0.5) < 0.05 ? 0.6 : 0.2;
+            double value = swell*sin(2*M_PI*(220 + 110*c)*t) + 0.05*((int32_t)noise / 2147483648.0);
+            put_uint(header + 44 + (size_t)f*frame_bytes + 2*c, (uint32_t)(int32_t)(value*32767), 2);
+        }
+    }
+
+    FILE* out = fopen(path, "wb");
+    if(out == NULL)
+        return 1;
+    bool ok = fwrite(file.data(), 1, file.size(), out) == file.size();
+    return fclose(out) != 0 || !ok;
+}
+
+bool close_to(double value, double expected){
+
+    return fabs(value - expected) <= TEST_TOLERANCE * std::max(1.0, fabs(expected));
+}
+
+int load_test_track(Track* t){
+
+    unload_track(t);
+    t->filename = test_wav;
+    t->index = 0;
+    if(LOAD_AUDIO_FILE(t))
+        return -1;
+    return initializer_vars(t) ? 1 : 0;
+}
+
+int compare_with_sequential(const Track* t){
+
+    Analyzer* a = analyzer_create(&t->config, NULL);
+    if(a == NULL){
+        printf("  sequential: analyzer_create failed\n");
+        return 1;
+    }
+    int failed = 0;
+    const FFT_results& r = t->fft_results;
+    for(int cc=0; cc<t->blocks && failed < 5; cc++){
+        const Uint8* buffer;
+        size_t bytes = block_bytes(t, cc, &buffer);
+        AnalyzerFrame frame;
+        analyzer_block(a, buffer, bytes, cc, &frame);
+        for(int c=0; c<frame.channels; c++){
+            size_t entry = (size_t)cc*r.channels + c;
+            const float* feature = r.feature + entry*FEATURES;
+            bool same = r.peakfreq[entry] == (uint32_t)frame.peak_hz[c]
+                     && close_to(feature[FEATURE_RMS], frame.features[c].rms_db)
+                     && close_to(feature[FEATURE_CENTROID], frame.features[c].centroid_hz)
+                     && close_to(feature[FEATURE_FLUX], frame.features[c].flux)
+                     && r.onset[entry] == (uint8_t)frame.features[c].onset;
+            for(int g=0; g<frame.bands; g++)
+                same = same && close_to(r.band_db[entry*r.bands + g], frame.level[c*frame.bands + g]);
+            if(!same){
+                printf("  block %d channel %d differs from the sequential analysis (flux %.6f, expected %.6f)\n",
+                       cc, c, feature[FEATURE_FLUX], frame.features[c].flux);
+                failed++;
+            }
+        }
+    }
+    analyzer_destroy(a);
+    return failed;
+}
+
+void* snapshot_writer(void *arg){
+
+    for(long long n=1; !reader_done.load(std::memory_order_acquire); n++)
+        publish_playback(&tracks[n & 1], n, 3*n, 5*n);
+    return NULL;
+}
+
+int test_snapshot_seqlock(){
+
+    publish_playback(&tracks[0], 0, 0, 0);
+    reader_done = false;
+    pthread_t writer;
+    if(pthread_create(&writer, NULL, snapshot_writer, NULL) != 0){
+        printf("  seqlock: could not start the writer\n");
+        return 1;
+    }
+
+    long long reads = 0, torn = 0, backwards = 0, last = 0;
+    uint64_t end = monotonic_ns() + SNAPSHOT_TEST_NS;
+    while(monotonic_ns() < end){
+        long long frame, latency;
+        uint64_t time_ns;
+        const Track* track;
+        read_playback(frame, time_ns, latency, track);
+        reads++;
+        if(time_ns != (uint64_t)(3*frame) || latency != 5*frame || track != &tracks[frame & 1])
+            torn++;
+        if(frame < last)
+            backwards++;
+        last = frame;
+    }
+    reader_done.store(true, std::memory_order_release);
+    pthread_join(writer, NULL);
+
+    if(torn || backwards){
+        printf("  seqlock: %lld of %lld reads torn, %lld went back in time\n", torn, reads, backwards);
+        return 1;
+    }
+    return 0;
+}
+
+int test_transport_queue(){
+
+    Track* t = &tracks[0];
+    if(load_test_track(t) < 0)
+        return 1;
+    AudioData audio;
+    memset(&audio, 0, sizeof(audio));
+    cue_track(&audio, t);
+    playing.store(t);
+    transport.head = transport.tail = 0;
+
+    //exactly a queue's worth: an absolute seek, a relative one, single steps and a pause
+    int failed = 0;
+    bool sent = send_transport(TRANSPORT_SEEK_TO, 1000) && send_transport(TRANSPORT_SEEK_BY, -300);
+    for(unsigned i=0; i<TRANSPORT_QUEUE_SIZE - 3; i++)
+        sent = sent && send_transport(TRANSPORT_SEEK_BY, 1);
+    sent = sent && send_transport(TRANSPORT_PAUSE, 0);
+    if(!sent || send_transport(TRANSPORT_PLAY, 0)){
+        printf("  transport: the queue doesn't hold exactly %u commands\n", TRANSPORT_QUEUE_SIZE);
+        failed++;
+    }
+
+    //the control loop's retry gives up on a stalled callback and says so
+    status_message.store(nullptr);
+    if(queue_transport(TRANSPORT_PLAY, 0) || status_message.load() == nullptr){
+        printf("  transport: a command dropped on a full queue isn't reported\n");
+        failed++;
+    }
+    status_message.store(nullptr);
+
+    apply_transport(&audio);
+    long long frame = (audio.pos - audio.beginning) / audio.frame_bytes;
+    long long expected = 1000 - 300 + (TRANSPORT_QUEUE_SIZE - 3);
+    if(frame != expected || !audio.paused || audio.length != audio.data_size - expected*audio.frame_bytes){
+        printf("  transport: at frame %lld %s, expected frame %lld paused\n", frame, audio.paused ? "paused" : "playing", expected);
+        failed++;
+    }
+    if(!send_transport(TRANSPORT_PLAY, 0)){
+        printf("  transport: the queue is still full after the callback emptied it\n");
+        failed++;
+    }
+    apply_transport(&audio);
+    if(audio.paused){
+        printf("  transport: play after the queue wrapped was lost\n");
+        failed++;
+    }
+    return failed;
+}
+
+int test_pool_matches_sequential(){
+
+    Track* t = &tracks[0];
+    bool cache = cache_enabled;
+    cache_enabled = false;
+    int failed = 0;
+
+    //one worker never has to prime; with several, every worker's first run and every stolen one does
+    int counts[] = { 1, TEST_POOL_WORKERS };
+    for(int i=0; i<2; i++){
+        if(load_test_track(t) != 0){
+            failed++;
+            break;
+        }
+        release_stats();
+        analysis_workers = counts[i];
+        ANALYZE_ALL_BLOCKS(t);
+        StageSummary primes;
+        summarize_stage(STAT_PRIME, primes);
+        if(t->analysis.produced.load() != t->blocks){
+            printf("  pool of %d: %d of %d blocks analyzed\n", counts[i], t->analysis.produced.load(), t->blocks);
+            failed++;
+        }
+        if(counts[i] == 1 && primes.count != 0){
+            printf("  pool of 1: %llu flux primes counted, there is nothing to prime\n", (unsigned long long)primes.count);
+            failed++;
+        }
+        if(counts[i] > 1 && (primes.count == 0 || primes.count >= (uint64_t)t->blocks)){
+            printf("  pool of %d: %llu flux primes counted for %d blocks\n", counts[i], (unsigned long long)primes.count, t->blocks);
+            failed++;
+        }
+        failed += compare_with_sequential(t);
+    }
+    analysis_workers = 0;
+    cache_enabled = cache;
+    return failed;
+}
+
+void* steal_worker(void *arg){
+
+    AnalysisWorker* self = (AnalysisWorker*)arg;
+    BlockRange r;
+    do{
+        while(take_blocks(self, r)){
+            for(int b=r.begin; b<r.end; b++)
+                steal_check.taken[b].fetch_add(1, std::memory_order_relaxed);
+            if(self->index == 0)
+                sched_yield();                      //a slow worker, so the others run dry and steal from it
+        }
+    }while(steal_blocks(self));
+    return NULL;
+}
+
+int test_work_stealing(){
+
+    //lopsided on purpose: worker 0 has most of the blocks, the last one none
+    steal_check.taken = new std::atomic<int>[STEAL_BLOCKS]();
+    workers = new AnalysisWorker[STEAL_THREADS];
+    pool_size = STEAL_THREADS;
+    int start[STEAL_THREADS + 1] = { 0, STEAL_BLOCKS*7/10, STEAL_BLOCKS*9/10, STEAL_BLOCKS, STEAL_BLOCKS };
+    for(int w=0; w<STEAL_THREADS; w++){
+        workers[w].index = w;
+        workers[w].track = NULL;
+        pthread_mutex_init(&workers[w].lock, NULL);
+        workers[w].range.begin = start[w];
+        workers[w].range.end = start[w + 1];
+    }
+    int started = 0;
+    for(int w=0; w<STEAL_THREADS; w++){
+        if(pthread_create(&workers[w].tid, NULL, steal_worker, &workers[w]) != 0)
+            break;
+        started++;
+    }
+    for(int w=0; w<started; w++)
+        pthread_join(workers[w].tid, NULL);
+
+    int failed = 0;
+    if(started == 0){
+        printf("  stealing: no worker could be started\n");
+        failed++;
+    }
+    for(int b=0; b<STEAL_BLOCKS && failed < 5; b++)
+        if(steal_check.taken[b].load() != 1){
+            printf("  stealing: block %d was handed out %d times\n", b, steal_check.taken[b].load());
+            failed++;
+        }
+
+    for(int w=0; w<STEAL_THREADS; w++)
+        pthread_mutex_destroy(&workers[w].lock);
+    delete [] workers;
+    workers = nullptr;
+    delete [] steal_check.taken;
+    return failed;
+}
+
+int test_analysis_cache(){
+
+    Track* t = &tracks[0];
+    cache_enabled = true;
+    analysis_workers = TEST_POOL_WORKERS;
+    int failed = 0;
+
+    if(load_test_track(t) != 0){
+        printf("  cache: the first open of the file was a hit\n");
+        return 1;
+    }
+    ANALYZE_ALL_BLOCKS(t);                          //stores the cache
+    const FFT_results& r = t->fft_results;
+    size_t entries = (size_t)r.blocks * r.channels;
+    std::vector<uint8_t> level(r.level, r.level + entries*r.bands);
+    std::vector<float> band_db(r.band_db, r.band_db + entries*r.bands);
+    std::vector<uint32_t> peakfreq(r.peakfreq, r.peakfreq + entries);
+    std::vector<float> feature(r.feature, r.feature + entries*FEATURES);
+    std::vector<uint8_t> onset(r.onset, r.onset + entries);
+
+    if(load_test_track(t) != 1){
+        printf("  cache: the second open of the file missed\n");
+        failed++;
+    }
+    else if(memcmp(level.data(), r.level, level.size()) != 0
+            || memcmp(band_db.data(), r.band_db, band_db.size()*sizeof(float)) != 0
+            || memcmp(peakfreq.data(), r.peakfreq, peakfreq.size()*sizeof(uint32_t)) != 0
+            || memcmp(feature.data(), r.feature, feature.size()*sizeof(float)) != 0
+            || memcmp(onset.data(), r.onset, onset.size()) != 0){
+        printf("  cache: the mapped results differ from the ones analyzed\n");
+        failed++;
+    }
+    unload_track(t);
+
+    //rewrite one sample inside a sampled chunk: same size, same inode, and the old mtime put back
+    struct stat st;
+    int fd = open(test_wav, O_RDWR);
+    off_t span = 0;
+    if(fd < 0 || fstat(fd, &st) != 0){
+        printf("  cache: could not reopen the test file\n");
+        failed++;
+    }
+    else{
+        span = st.st_size - (off_t)CACHE_KEY_CHUNK_BYTES;
+        off_t at = span * (CACHE_KEY_CHUNKS/2) / (CACHE_KEY_CHUNKS - 1) + 64;
+        Uint8 sample[2];
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if(pread(fd, sample, 2, at) != 2)
+            failed++;
+        sample[0] ^= 0x55;
+        if(pwrite(fd, sample, 2, at) != 2 || futimens(fd, times) != 0)
+            failed++;
+    }
+    if(fd >= 0)
+        close(fd);
+    if(!failed && load_test_track(t) != 0){
+        printf("  cache: a file with new content, the same size and the old mtime was a hit\n");
+        failed++;
+    }
+    unload_track(t);
+
+    analysis_workers = 0;
+    cache_enabled = false;
+    return failed;
+}
+
+int test_ring_arrival(){
+
+    live_ring.size = 4096;
+    live_ring.data = new Uint8[live_ring.size];
+    live_ring.head = live_ring.tail = live_ring.writes = 0;
+    Uint8 chunk[100] = { 0 };
+    uint64_t before[3], after[3];
+    int failed = 0;
+
+    for(int i=0; i<3; i++){
+        before[i] = monotonic_ns();
+        if(!ring_write(chunk, sizeof(chunk)))
+            failed++;
+        after[i] = monotonic_ns();
+        SDL_Delay(2);
+    }
+    //byte positions: 1..100 came with write 0, 101..200 with write 1, 201..300 with write 2
+    size_t positions[] = { 1, 100, 101, 200, 201, 300 };
+    int expected[] = { 0, 0, 1, 1, 2, 2 };
+    for(int i=0; i<6; i++){
+        uint64_t ns = ring_arrival(positions[i]);
+        if(ns < before[expected[i]] || ns > after[expected[i]]){
+            printf("  ring: position %zu isn't stamped with write %d\n", positions[i], expected[i]);
+            failed++;
+        }
+    }
+    uint64_t now = monotonic_ns();
+    if(ring_arrival(301) < now){                    //not written yet: it arrives now at the earliest
+        printf("  ring: a position past the head has an arrival time\n");
+        failed++;
+    }
+
+    delete [] live_ring.data;
+    live_ring.data = NULL;
+    return failed;
+}
+
+int test_batch_csv(){
+
+    int failed = 0;
+    const char* fields[] = { "plain.wav", "a,b.wav", "say \"hi\".wav", "two\nlines.wav" };
+    const char* quoted[] = { "plain.wav", "\"a,b.wav\"", "\"say \"\"hi\"\".wav\"", "\"two\nlines.wav\"" };
+    for(int i=0; i<4; i++){
+        char* text = NULL;
+        size_t size = 0;
+        FILE* out = open_memstream(&text, &size);
+        write_csv_field(out, fields[i]);
+        fclose(out);
+        if(strcmp(text, quoted[i]) != 0){
+            printf("  csv: \"%s\" written as %s\n", fields[i], text);
+            failed++;
+        }
+        free(text);
+    }
+
+    //a level below 0 dB and a peak above what 16 bits hold must come out as they are
+    Track* t = &tracks[0];
+    if(load_test_track(t) != 0)
+        return failed + 1;
+    ANALYZE_ALL_BLOCKS(t);
+    t->fft_results.band_db[0] = -12.5f;
+    t->fft_results.peakfreq[0] = 70000;
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    write_results_csv(t, out, true);
+    fclose(out);
+
+    char* row = strchr(text, '\n') + 1;             //block 0, channel 0
+    std::vector<string> cells;
+    for(char* cell = row; ; ){
+        char* end = cell + strcspn(cell, ",\n");
+        cells.push_back(string(cell, end));
+        if(*end != ',')
+            break;
+        cell = end + 1;
+    }
+    if(cells.size() != (size_t)(11 + t->fft_results.bands) || cells[4] != "70000" || cells[11] != "-12.5"){
+        printf("  csv: first row has %zu cells, peak_hz %s and band0_db %s\n", cells.size(),
+               cells.size() > 4 ? cells[4].c_str() : "-", cells.size() > 11 ? cells[11].c_str() : "-");
+        failed++;
+    }
+    free(text);
+    unload_track(t);
+    return failed;
+}